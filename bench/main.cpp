@@ -0,0 +1,230 @@
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <benchmark/benchmark.h>
+#include "structs.hpp"
+#include "simulator.hpp"
+#include "scenario.hpp"
+
+// Microbenchmarks for the hot sRect/sCrossing queries and a macrobenchmark per
+// pipeline stage on the default map and on a grid map. Results go to
+// bench_results.json unless --benchmark_out is given, so runs of two versions
+// can be compared with Google Benchmark's tools/compare.py.
+
+static constexpr int GRID_COLUMNS = 8;
+static constexpr int GRID_ROWS = 8;
+static constexpr int GRID_WIDTH = 4 * SCREEN_WIDTH;
+static constexpr int GRID_HEIGHT = 4 * SCREEN_HEIGHT;
+static constexpr int WARMUP_TICKS = 10;
+
+struct sBenchMap {
+  const char *name;
+  int width, height;
+  sRoadData (*create)(uint64_t seed);
+};
+
+static const sBenchMap benchMaps[] = {
+    {"default", SCREEN_WIDTH, SCREEN_HEIGHT, [](uint64_t seed) { return createDefaultRoadData(seed); }},
+    {"grid", GRID_WIDTH, GRID_HEIGHT, [](uint64_t seed) { return createGridRoadData(GRID_COLUMNS, GRID_ROWS, GRID_WIDTH, GRID_HEIGHT, seed); }},
+};
+
+// Road data with cars already pushed apart and a few ticks of traffic behind it
+static sRoadData createWarmRoadData(const sBenchMap &map, int carsCount, sSimulationFrame &frame) {
+  sRoadData roadData = map.create(1);
+  spawnCars(roadData, carsCount);
+  queueCarsBehindSpawns(roadData);
+  for (int tick = 0; tick < WARMUP_TICKS; ++tick) {
+    simulateTick(roadData, frame, map.width, map.height);
+  }
+  return roadData;
+}
+
+static sRoadData createWarmRoadData(int carsCount) {
+  sSimulationFrame frame;
+  return createWarmRoadData(benchMaps[0], carsCount, frame);
+}
+
+static void BM_RectOverlaps(benchmark::State &state) {
+  sRandom random(1);
+  std::vector<sRect> rects;
+  for (int i = 0; i < 1024; ++i) {
+    rects.emplace_back(random.nextBelow(SCREEN_WIDTH), random.nextBelow(SCREEN_HEIGHT), CAR_SIZE_BIG, CAR_SIZE_SMALL);
+  }
+  for (auto _ : state) {
+    int overlapping = 0;
+    for (size_t i = 0; i + 1 < rects.size(); ++i) {
+      overlapping += rects[i].overlaps(rects[i + 1]);
+    }
+    benchmark::DoNotOptimize(overlapping);
+  }
+  state.SetItemsProcessed(state.iterations() * (rects.size() - 1));
+}
+
+static void BM_GetCrossingInfo(benchmark::State &state) {
+  sRoadData roadData = createWarmRoadData(state.range(0));
+  const sCrossing &crossing = roadData.crossings.front();
+  for (auto _ : state) {
+    for (size_t car = 0; car < roadData.cars.size(); ++car) {
+      benchmark::DoNotOptimize(crossing.getCrossingInfo(roadData.cars, car));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * roadData.cars.size());
+  destroyCars(roadData);
+}
+
+// A crossing with a car waiting on each side, the case where every car is checked
+static void BM_IsDeadlocked(benchmark::State &state) {
+  sRoadData roadData = createDefaultRoadData(1);
+  sCrossing &crossing = roadData.crossings.front();
+  const sRect &rect = crossing.rect;
+  const std::pair<sVec, eCarAlignment> waiting[] = {
+      {sVec(rect.p1.x - CAR_SIZE_BIG, rect.p1.y), eCarAlignment::CAR_MOVE_EAST},
+      {sVec(rect.p2.x, rect.p2.y - CAR_SIZE_SMALL), eCarAlignment::CAR_MOVE_WEST},
+      {sVec(rect.p2.x - CAR_SIZE_SMALL, rect.p2.y), eCarAlignment::CAR_MOVE_SOUTH},
+      {sVec(rect.p1.x, rect.p1.y - CAR_SIZE_BIG), eCarAlignment::CAR_MOVE_NORTH},
+  };
+  for (auto &car : waiting) {
+    auto *gasCar = new sGasCar();
+    gasCar->rect = sRect(CAR_SIZE_BIG, CAR_SIZE_SMALL);
+    gasCar->setAlignment(car.second);
+    gasCar->rect.moveTo(car.first);
+    gasCar->checkSides = true;
+    roadData.cars.push_back(gasCar);
+    crossing.addCar(roadData.cars, roadData.cars.size() - 1);
+  }
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(crossing.isDeadlocked(roadData.cars));
+  }
+  destroyCars(roadData);
+}
+
+BENCHMARK(BM_RectOverlaps);
+BENCHMARK(BM_GetCrossingInfo)->Arg(20)->Arg(1000);
+BENCHMARK(BM_IsDeadlocked);
+
+// Decision pass alone, full scan versus grid and lane lookups
+static void BM_DecisionScan(benchmark::State &state) {
+  sRoadData roadData = createWarmRoadData(state.range(0));
+  auto verboseCarsInfo = getVerboseCarsInfo(roadData);
+  for (auto _ : state) {
+    for (auto &carInfo : verboseCarsInfo) {
+      benchmark::DoNotOptimize(getNextCarPositionPair(carInfo, verboseCarsInfo, roadData));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  destroyCars(roadData);
+}
+
+static void BM_DecisionGrid(benchmark::State &state) {
+  sRoadData roadData = createWarmRoadData(state.range(0));
+  auto verboseCarsInfo = getVerboseCarsInfo(roadData);
+  sCarGrid grid;
+  sLaneIndex lanes;
+  std::vector<sCarMove> moveData;
+  for (auto _ : state) {
+    getNextCarsPositionPairs(roadData, verboseCarsInfo, grid, lanes, moveData);
+    benchmark::DoNotOptimize(moveData.data());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  destroyCars(roadData);
+}
+
+BENCHMARK(BM_DecisionScan)->RangeMultiplier(4)->Range(16, 4096)->Unit(benchmark::kMicrosecond);
+BENCHMARK(BM_DecisionGrid)->RangeMultiplier(4)->Range(16, 16384)->Unit(benchmark::kMicrosecond);
+
+enum eStage {
+  STAGE_RESOLVE_COLLISIONS,
+  STAGE_RESPAWN_OUT_OF_FIELD_CARS,
+  STAGE_GET_VERBOSE_CARS_INFO,
+  STAGE_GET_NEXT_CARS_POSITION_PAIRS,
+  STAGE_RESOLVE_DEADLOCKS,
+  STAGE_HANDLE_MOVINGS,
+  STAGE_TICK,
+  STAGE_COUNT
+};
+
+static const char *stageNames[STAGE_COUNT] = {
+    "resolveCollisions",         //
+    "respawnOutOfFieldCars",     //
+    "getVerboseCarsInfo",        //
+    "getNextCarsPositionPairs",  //
+    "resolveDeadlocks",          //
+    "handleMovings",             //
+    "simulateTick",              //
+};
+
+// Every iteration runs a whole tick so the state keeps evolving as in a real
+// run, but only the measured stage is timed
+static void BM_Stage(benchmark::State &state, eStage measured, const sBenchMap *map) {
+  sSimulationFrame frame;
+  sRoadData roadData = createWarmRoadData(*map, state.range(0), frame);
+  int width = map->width, height = map->height;
+
+  double seconds = 0;
+  auto timed = [&](eStage stage, auto fn) {
+    if (stage != measured) {
+      fn();
+      return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  };
+
+  for (auto _ : state) {
+    timed(STAGE_TICK, [&] {
+      timed(STAGE_RESOLVE_COLLISIONS, [&] { resolveCollisions(roadData, frame.broadphase); });
+      timed(STAGE_RESPAWN_OUT_OF_FIELD_CARS, [&] { respawnOutOfFieldCars(roadData, width, height, frame.broadphase); });
+      timed(STAGE_GET_VERBOSE_CARS_INFO, [&] { getVerboseCarsInfo(roadData, frame.verboseCarsInfo); });
+      timed(STAGE_GET_NEXT_CARS_POSITION_PAIRS, [&] { getNextCarsPositionPairs(roadData, frame.verboseCarsInfo, frame.grid, frame.lanes, frame.moveData, frame.pool); });
+      timed(STAGE_RESOLVE_DEADLOCKS, [&] { resolveDeadlocks(roadData); });
+      timed(STAGE_HANDLE_MOVINGS, [&] { handleMovings(roadData, frame.moveData); });
+    });
+    state.SetIterationTime(seconds);
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  destroyCars(roadData);
+}
+
+// The stage alone can take a tiny share of the tick, so the tick count is fixed
+// per population rather than grown until the measured time adds up
+static void registerStageBenchmarks() {
+  const int carsCounts[] = {20, 1000, 10000, 100000};
+  for (auto &map : benchMaps) {
+    for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+      std::string name = std::string("BM_Stage/") + stageNames[stage] + "/" + map.name;
+      for (int carsCount : carsCounts) {
+        benchmark::RegisterBenchmark(name.c_str(), BM_Stage, static_cast<eStage>(stage), &map)  //
+            ->Arg(carsCount)
+            ->Iterations(std::max(10, 2000000 / carsCount))
+            ->UseManualTime()
+            ->Unit(benchmark::kMicrosecond);
+      }
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  std::vector<char *> args(argv, argv + argc);
+  bool hasOut = false;
+  for (int i = 1; i < argc; ++i) {
+    hasOut = hasOut || std::strncmp(argv[i], "--benchmark_out=", 16) == 0;
+  }
+  std::string out = "--benchmark_out=bench_results.json";
+  std::string outFormat = "--benchmark_out_format=json";
+  if (!hasOut) {
+    args.push_back(&out[0]);
+    args.push_back(&outFormat[0]);
+  }
+  int argsCount = static_cast<int>(args.size());
+
+  registerStageBenchmarks();
+  benchmark::Initialize(&argsCount, args.data());
+  if (benchmark::ReportUnrecognizedArguments(argsCount, args.data()))
+    return 1;
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,229 @@
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <memory>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#include "structs.hpp"
+#include "simulator.hpp"
+#include "scenario.hpp"
+#include "trace.hpp"
+#include "snapshot.hpp"
+#include "events.hpp"
+#include "tiles.hpp"
+#include "distributed.hpp"
+
+// Runs the simulation pipeline without any display and reports throughput.
+// Usage: headless <cars> <ticks> <seed> [decision threads] [trace file] [--load <snapshot>] [--save <snapshot>]
+//                 [--scenario <file> | --grid <columns>x<rows>] [--events | --check-events | --tiles <columns>x<rows> | --processes <count>]
+// The road and field come from the scenario or grid, the default road otherwise.
+// --load starts from a saved road and field instead, ignoring cars, seed, scenario and grid;
+// --save writes the road as it is after the last tick.
+// --events skips quiet ticks with the event engine; --check-events does too and
+// also runs the plain ticks alongside, stopping at the first tick they differ.
+// --tiles splits the field into that many tiles run by the decision threads.
+// --processes splits the field into that many bands, each run by its own process (POSIX only).
+
+static long peakRssKb() {
+#ifndef _WIN32
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+    return usage.ru_maxrss;
+#endif
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  std::vector<const char *> args;
+  const char *loadPath = nullptr, *savePath = nullptr, *scenarioPath = nullptr, *gridSize = nullptr, *tilesSize = nullptr;
+  bool useEvents = false, checkEvents = false;
+  int processes = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--load") == 0 && i + 1 < argc)
+      loadPath = argv[++i];
+    else if (std::strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+      savePath = argv[++i];
+    else if (std::strcmp(argv[i], "--scenario") == 0 && i + 1 < argc)
+      scenarioPath = argv[++i];
+    else if (std::strcmp(argv[i], "--grid") == 0 && i + 1 < argc)
+      gridSize = argv[++i];
+    else if (std::strcmp(argv[i], "--tiles") == 0 && i + 1 < argc)
+      tilesSize = argv[++i];
+    else if (std::strcmp(argv[i], "--processes") == 0 && i + 1 < argc)
+      processes = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "--events") == 0)
+      useEvents = true;
+    else if (std::strcmp(argv[i], "--check-events") == 0)
+      useEvents = checkEvents = true;
+    else
+      args.push_back(argv[i]);
+  }
+  if (args.size() < 3 || args.size() > 5) {
+    std::cerr << "Usage: " << argv[0] << " <cars> <ticks> <seed> [decision threads] [trace file] [--load <snapshot>] [--save <snapshot>]"
+              << " [--scenario <file> | --grid <columns>x<rows>] [--events | --check-events | --tiles <columns>x<rows> | --processes <count>]"
+              << std::endl;
+    return 1;
+  }
+  int tileColumns = 0, tileRows = 0;
+  if (tilesSize != nullptr) {
+    char separator = 0;
+    if (std::sscanf(tilesSize, "%d%c%d", &tileColumns, &separator, &tileRows) != 3 || separator != 'x' || tileColumns <= 0 || tileRows <= 0) {
+      std::cerr << "Tiles should look like 4x4, not " << tilesSize << std::endl;
+      return 1;
+    }
+    if (useEvents) {
+      std::cerr << "--tiles can't be combined with the event engine" << std::endl;
+      return 1;
+    }
+  }
+  if (processes != 0) {
+#ifdef _WIN32
+    std::cerr << "--processes needs a POSIX system" << std::endl;
+    return 1;
+#endif
+    if (processes < 0 || useEvents || tilesSize != nullptr || args.size() == 5) {
+      std::cerr << "--processes takes a positive count and can't be combined with --events, --tiles or a trace" << std::endl;
+      return 1;
+    }
+  }
+
+  int carsCount = std::atoi(args[0]);
+  long ticks = std::atol(args[1]);
+  uint64_t seed = std::strtoull(args[2], nullptr, 10);
+  int threads = args.size() >= 4 ? std::atoi(args[3]) : 1;
+  if (carsCount <= 0 || ticks <= 0 || threads <= 0) {
+    std::cerr << "cars, ticks and threads must be positive" << std::endl;
+    return 1;
+  }
+
+  int fieldWidth, fieldHeight;
+  auto createStartRoad = [&]() {
+    if (loadPath != nullptr)
+      return loadSnapshot(loadPath, fieldWidth, fieldHeight);
+    sRoadData roadData = createRoadDataFromOptions(scenarioPath, gridSize, seed, fieldWidth, fieldHeight);
+    spawnCars(roadData, carsCount);
+    return roadData;
+  };
+
+  auto loadStart = std::chrono::steady_clock::now();
+  sRoadData roadData = createStartRoad();
+  if (loadPath != nullptr) {
+    carsCount = static_cast<int>(roadData.cars.size());
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - loadStart).count();
+    std::printf("loaded %s in %.1f ms\n", loadPath, loadMs);
+  }
+  sThreadPool pool(threads - 1);
+  sSimulationFrame frame;
+  frame.pool = &pool;
+  // the initial state is tick 0 of the trace
+  std::unique_ptr<sTraceWriter> trace;
+  if (args.size() == 5) {
+    trace.reset(new sTraceWriter(args[4], roadData));
+    trace->record(roadData);
+  }
+#ifdef SIM_PROFILE
+  sProfiler profiler;
+  frame.profiler = &profiler;
+#endif
+
+  std::unique_ptr<sTiledWorld> tiled;
+  if (tilesSize != nullptr) {
+    tiled.reset(new sTiledWorld(fieldWidth, fieldHeight, tileColumns, tileRows));
+    tiled->pool = &pool;
+  }
+
+#ifndef _WIN32
+  // forked last, so the workers start from the road as set up above; the cars go to the bands until gathered back
+  std::unique_ptr<sDistributedRoad> distributed;
+  if (processes != 0)
+    distributed.reset(new sDistributedRoad(roadData, fieldWidth, fieldHeight, processes));
+#endif
+
+  std::unique_ptr<sEventEngine> events;
+  if (useEvents)
+    events.reset(new sEventEngine(fieldWidth, fieldHeight));
+  // the same road run by plain ticks for --check-events
+  std::unique_ptr<sRoadData> ticked;
+  sSimulationFrame tickedFrame;
+  if (checkEvents)
+    ticked.reset(new sRoadData(createStartRoad()));
+
+  auto start = std::chrono::steady_clock::now();
+  if (events && !trace && !ticked) {
+    events->advance(roadData, frame, ticks);
+  } else {
+    for (long tick = 0; tick < ticks; ++tick) {
+      if (events)
+        events->advance(roadData, frame, 1);
+      else if (tiled)
+        tiled->tick(roadData, fieldWidth, fieldHeight);
+#ifndef _WIN32
+      else if (distributed)
+        distributed->tick();
+#endif
+      else
+        simulateTick(roadData, frame, fieldWidth, fieldHeight);
+      if (ticked) {
+        simulateTick(*ticked, tickedFrame, fieldWidth, fieldHeight);
+        if (!sameRoadState(roadData, *ticked)) {
+          std::cerr << "event engine differs from plain ticks at tick " << tick + 1 << std::endl;
+          return 1;
+        }
+      }
+      if (trace)
+        trace->record(roadData);
+      PROFILE_END_FRAME(profiler);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  if (trace)
+    trace->close();
+#ifndef _WIN32
+  if (distributed)
+    distributed->gather(roadData);
+#endif
+
+  double elapsedNs = std::chrono::duration<double, std::nano>(end - start).count();
+  double ticksPerSecond = ticks / (elapsedNs / 1e9);
+
+  std::printf("cars: %d, ticks: %ld, seed: %llu, threads: %d\n", carsCount, ticks, static_cast<unsigned long long>(seed), threads);
+  std::printf("field: %dx%d, segments: %zu, crossings: %zu\n", fieldWidth, fieldHeight, roadData.roadSegments.size(), roadData.crossings.size());
+  if (tiled)
+    std::printf("tiles: %dx%d\n", tileColumns, tileRows);
+  std::printf("elapsed: %.3f s\n", elapsedNs / 1e9);
+  std::printf("ticks/s: %.1f\n", ticksPerSecond);
+  // a loaded snapshot may have no cars
+  if (carsCount > 0)
+    std::printf("ns per car-tick: %.1f\n", elapsedNs / (static_cast<double>(ticks) * carsCount));
+  else
+    std::printf("ns per car-tick: n/a\n");
+#ifndef _WIN32
+  if (distributed) {
+    for (size_t region = 0; region < distributed->regions.size(); ++region) {
+      const sRegionStats &stats = distributed->regions[region];
+      std::printf("process %zu: %zu cars, %ld car-ticks, %ld halo car-ticks, %ld arrivals", region, stats.cars, stats.carTicks, stats.haloCarTicks, stats.arrivals);
+      if (!stats.alive)
+        std::printf(", failed, band taken over for %ld ticks", stats.takenOverTicks);
+      std::printf("\n");
+    }
+  }
+#endif
+  if (events)
+    std::printf("event engine: %ld ticks skipped, %ld stepped\n", events->skippedTicks, events->steppedTicks);
+  if (ticked)
+    std::printf("event engine matched plain ticks\n");
+  std::printf("peak RSS: %ld KB\n", peakRssKb());
+  PROFILE_REPORT(profiler);
+
+  if (savePath != nullptr)
+    saveSnapshot(roadData, fieldWidth, fieldHeight, savePath);
+
+  if (ticked)
+    destroyCars(*ticked);
+  destroyCars(roadData);
+  return 0;
+}
@@ -0,0 +1,701 @@
+#ifndef MYTONA_DISTRIBUTED_HPP
+#define MYTONA_DISTRIBUTED_HPP
+
+#ifndef _WIN32
+
+#include <vector>
+#include <string>
+#include <tuple>
+#include <map>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <cerrno>
+#include <stdexcept>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "structs.hpp"
+#include "simulator.hpp"
+#include "snapshot.hpp"
+
+// The road run by several processes on one host, POSIX only: a coordinator
+// and workers forked from it, each connected to the coordinator by a Unix
+// domain socket pair. The field is split into vertical bands, one per
+// process, and a process holds only the cars of its band, its own cars, plus
+// copies of the cars within the halo margin of its edges, its ghosts. Every
+// tick in lockstep the workers send the coordinator the cars that left their
+// band and the ones near its edges; the coordinator hands each car to the
+// process of its band and the copies to the processes around it, then every
+// process ticks its own cars against its ghosts with its own random stream.
+// One process runs as simulateTick does; more run close to it but not
+// exactly, as a band sees its neighbours' cars from the start of the tick.
+//
+// Workers save their cars to a checkpoint file every CHECKPOINT_TICKS ticks
+// and the coordinator logs the cars handed over since. A worker that fails or
+// doesn't answer within the timeout is dropped; the coordinator takes its
+// band over from the checkpoint and the log, so the run keeps every car, with
+// the ones of the failed band back where they last were seen.
+
+struct sRegionStats {
+  size_t cars = 0;          // cars of the band after the last tick
+  long carTicks = 0;        // cars of the band ticked, summed over the ticks
+  long haloCarTicks = 0;    // ghosts ticked along by its process
+  long arrivals = 0;        // cars handed over from other bands
+  long takenOverTicks = 0;  // ticks the coordinator ran the band after its worker failed
+  bool alive = true;
+};
+
+struct sDistributedRoad {
+  enum : long { CHECKPOINT_TICKS = 64 };
+
+  // One per band, the coordinator's first
+  std::vector<sRegionStats> regions;
+
+  // Takes the cars out of the road and forks processes - 1 workers; gather puts them back
+  sDistributedRoad(sRoadData &roadData, int fieldWidth, int fieldHeight, int processes, int timeoutMs = 10000)
+      : regions(std::max(1, processes)),
+        fieldWidth(std::max(1, fieldWidth)),
+        fieldHeight(fieldHeight),
+        totalCars(roadData.cars.size()),
+        hosts(regions.size()),
+        logs(regions.size()),
+        checkpointTicks(regions.size(), 0),
+        local(createBandRoad(roadData, 0)) {
+    const char *directory = std::getenv("TMPDIR");
+    checkpointPrefix = std::string(directory != nullptr && *directory != '\0' ? directory : "/tmp") + "/cars_simulator_" + std::to_string(getpid()) + "_";
+    for (size_t region = 0; region < regions.size(); ++region) {
+      hosts[region] = region;
+    }
+
+    // the margin the tiles keep, for the whole road
+    int maxCarSize = 0, maxSpeed = 0, maxCrossingSize = 0;
+    sCarStore &cars = roadData.cars;
+    for (size_t i = 0; i < cars.size(); ++i) {
+      maxCarSize = std::max(maxCarSize, std::max(cars.sizes[i].x, cars.sizes[i].y));
+      maxSpeed = std::max(maxSpeed, std::abs(cars.speeds[i]));
+    }
+    for (auto &crossing : roadData.crossings) {
+      maxCrossingSize = std::max(maxCrossingSize, std::max(crossing.rect.width(), crossing.rect.height()));
+    }
+    margin = 3 * maxCarSize + maxSpeed + maxCrossingSize;
+
+    try {
+      for (size_t region = 1; region < regions.size(); ++region) {
+        forkWorker(roadData, region, timeoutMs);
+      }
+    } catch (...) {
+      // the workers forked so far see the socket close and exit
+      for (auto &worker : workers) {
+        close(worker.fd);
+        waitpid(worker.pid, nullptr, 0);
+      }
+      throw;
+    }
+
+    // handed to their bands by the first tick
+    for (size_t i = 0; i < cars.size(); ++i) {
+      pending.push_back(createRecord(cars, i, static_cast<uint32_t>(i), true));
+    }
+    destroyCars(roadData);
+    cars.clear();
+    for (auto &crossing : roadData.crossings) {
+      crossing.cars = sCrossingCars();
+    }
+  }
+
+  ~sDistributedRoad() {
+    for (size_t region = 1; region < regions.size(); ++region) {
+      sWorker &worker = workers[region - 1];
+      if (regions[region].alive) {
+        uint32_t command = STOP;
+        sendAll(worker.fd, &command, sizeof(command));
+        close(worker.fd);
+        removeCheckpoints(region);
+      }
+      waitpid(worker.pid, nullptr, 0);
+    }
+    for (size_t i = 0; i < local.ownCount; ++i) {
+      delete local.road.cars[i];
+    }
+  }
+
+  sDistributedRoad(const sDistributedRoad &) = delete;
+  sDistributedRoad &operator=(const sDistributedRoad &) = delete;
+
+  // One tick of every band
+  void tick() {
+    for (size_t region = 1; region < regions.size(); ++region) {
+      uint32_t command = TICK;
+      if (regions[region].alive && !sendAll(workers[region - 1].fd, &command, sizeof(command)))
+        takeOver(region, pending);
+    }
+
+    // what each worker sent: its cars that left the band, then its cars near the edges
+    std::vector<sOutgoingHeader> headers(regions.size());
+    std::vector<std::vector<sCarRecord>> outgoing(regions.size());
+    for (size_t region = 1; region < regions.size(); ++region) {
+      if (regions[region].alive && !receiveOutgoing(workers[region - 1].fd, headers[region], outgoing[region]))
+        takeOver(region, pending);
+    }
+    for (size_t region = 1; region < regions.size(); ++region) {
+      // the worker's checkpoint covers the hand-overs logged so far
+      if (regions[region].alive && headers[region].checkpointTick != checkpointTicks[region]) {
+        removeCheckpoint(region, checkpointTicks[region]);
+        checkpointTicks[region] = headers[region].checkpointTick;
+        logs[region].clear();
+      }
+    }
+
+    std::vector<bool> leaving;
+    std::vector<sCarRecord> ownOutgoing;
+    sOutgoingHeader &ownHeader = headers[0];
+    collectOutgoing(0, leaving, ownHeader, ownOutgoing);
+
+    // hosts hold the cars handed to them and the ghosts they need
+    std::vector<std::vector<sCarRecord>> arrivals(regions.size()), ghosts(regions.size());
+    route(pending, 0, pending.size(), HAND_OVER, arrivals, ghosts);
+    pending.clear();
+    routeOutgoing(0, ownHeader, ownOutgoing, arrivals, ghosts);
+    for (size_t region = 1; region < regions.size(); ++region) {
+      if (regions[region].alive)
+        routeOutgoing(region, headers[region], outgoing[region], arrivals, ghosts);
+    }
+
+    for (size_t region = 1; region < regions.size(); ++region) {
+      if (!regions[region].alive)
+        continue;
+      sRegionStats &stats = regions[region];
+      if (!sendIncoming(workers[region - 1].fd, arrivals[region], ghosts[region])) {
+        takeOver(region, arrivals[0]);
+        continue;
+      }
+      stats.cars = headers[region].ownCars - headers[region].leaving + arrivals[region].size();
+      stats.carTicks += static_cast<long>(stats.cars);
+      stats.haloCarTicks += static_cast<long>(ghosts[region].size());
+    }
+
+    local.apply(leaving, arrivals[0], ghosts[0]);
+    simulateTick(local.road, frame, fieldWidth, fieldHeight);
+    for (size_t region = 0; region < regions.size(); ++region) {
+      if (hosts[region] == 0)
+        regions[region].cars = 0;
+      if (region > 0 && !regions[region].alive)
+        ++regions[region].takenOverTicks;
+    }
+    for (size_t i = 0; i < local.ownCount; ++i) {
+      sRegionStats &stats = regions[regionOf(local.road.cars.x[i])];
+      ++stats.cars;
+      ++stats.carTicks;
+    }
+    regions[0].haloCarTicks += static_cast<long>(local.road.cars.size() - local.ownCount);
+  }
+
+  // Replaces the road's cars with the cars of every band, by their order in the road given to the constructor
+  void gather(sRoadData &roadData) {
+    std::vector<sCarRecord> records = pending;
+    size_t pendingBefore = pending.size();
+    for (size_t i = 0; i < local.ownCount; ++i) {
+      records.push_back(createRecord(local.road.cars, i, local.ids[i], true));
+    }
+    for (size_t region = 1; region < regions.size(); ++region) {
+      if (!regions[region].alive)
+        continue;
+      uint32_t command = GATHER;
+      sOutgoingHeader header;
+      std::vector<sCarRecord> workerCars;
+      if (!sendAll(workers[region - 1].fd, &command, sizeof(command)) || !receiveOutgoing(workers[region - 1].fd, header, workerCars)) {
+        // its cars join the coordinator's by the next tick
+        takeOver(region, pending);
+        continue;
+      }
+      records.insert(records.end(), workerCars.begin(), workerCars.end());
+    }
+    records.insert(records.end(), pending.begin() + pendingBefore, pending.end());
+    std::sort(records.begin(), records.end(), [](const sCarRecord &a, const sCarRecord &b) { return a.id < b.id; });
+    if (records.size() != totalCars)
+      throw std::runtime_error("The bands lost track of a car");
+    for (size_t i = 0; i < records.size(); ++i) {
+      if (records[i].id != i)
+        throw std::runtime_error("The bands lost track of a car");
+    }
+
+    destroyCars(roadData);
+    roadData.cars.clear();
+    for (auto &record : records) {
+      appendRecord(roadData.cars, record, createCarWithTanks(static_cast<eCarKind>(record.kind), record.tanks));
+    }
+    roadData.cars.syncToCars();
+  }
+
+  pid_t workerPid(size_t region) const { return workers[region - 1].pid; }
+
+ private:
+  enum : uint32_t { STOP = 0, TICK = 1, GATHER = 2 };
+  enum : size_t { HAND_OVER = SIZE_MAX };
+
+  struct sWorker {
+    pid_t pid;
+    int fd;
+  };
+
+  // A car as it goes over a socket or into a checkpoint; ghosts leave the tanks out
+  struct sCarRecord {
+    uint32_t id;
+    int32_t x, y;
+    sVec size, direction;
+    int32_t speed;
+    unsigned char flags, kind;
+    sCarTanks tanks;
+  };
+
+  struct sOutgoingHeader {
+    uint32_t leaving = 0;   // records of cars that left the band, first
+    uint32_t borders = 0;   // records of cars near its edges, after them
+    uint32_t ownCars = 0;   // cars of the band before the hand-over
+    long checkpointTick = 0;
+  };
+
+  struct sIncomingHeader {
+    uint32_t arrivals;
+    uint32_t ghosts;
+  };
+
+  // A car handed into or out of a worker's band since its checkpoint
+  struct sLogEntry {
+    bool arrived;
+    sCarRecord record;
+  };
+
+  // The road of one process: its own cars first, by arrival, then its ghosts
+  struct sBand {
+    sRoadData road;
+    std::vector<uint32_t> ids;  // of the own cars
+    size_t ownCount = 0;
+    sGasCar ghostHandle;  // ghosts are read only through the store, so they share it
+
+    explicit sBand(sRoadData road) : road(std::move(road)) {}
+
+    // Drops the leaving own cars and the ghosts, keeping the rest in their crossings in order, and adds the new ones
+    void apply(const std::vector<bool> &leaving, const std::vector<sCarRecord> &arrivals, const std::vector<sCarRecord> &ghosts) {
+      sCarStore &cars = road.cars;
+      if (arrivals.empty() && ghosts.empty() && cars.size() == ownCount && std::find(leaving.begin(), leaving.end(), true) == leaving.end())
+        return;
+
+      std::vector<std::tuple<int, int, size_t>> members;
+      for (size_t i = 0; i < cars.size(); ++i) {
+        if (cars.crossings[i] >= 0)
+          road.crossings[cars.crossings[i]].cars = sCrossingCars();
+      }
+      size_t kept = 0;
+      for (size_t i = 0; i < ownCount; ++i) {
+        if (leaving[i]) {
+          delete cars.handles[i];
+          continue;
+        }
+        if (cars.crossings[i] >= 0)
+          members.emplace_back(cars.crossings[i], cars.crossingSlots[i], kept);
+        moveCar(cars, i, kept);
+        ids[kept++] = ids[i];
+      }
+      resizeCars(cars, kept);
+      ids.resize(kept);
+
+      for (auto &record : arrivals) {
+        appendRecord(cars, record, createCarWithTanks(static_cast<eCarKind>(record.kind), record.tanks));
+        ids.push_back(record.id);
+      }
+      ownCount = cars.size();
+      for (auto &record : ghosts) {
+        appendRecord(cars, record, &ghostHandle);
+        // a ghost leaving the field is its owner's to respawn
+        cars.setFlag(cars.size() - 1, sCarStore::WAS_IN_FIELD, false);
+      }
+
+      std::sort(members.begin(), members.end());
+      for (auto &member : members) {
+        cars.crossings[std::get<2>(member)] = std::get<0>(member);
+        road.crossings[std::get<0>(member)].addCar(cars, std::get<2>(member));
+      }
+    }
+  };
+
+  int fieldWidth, fieldHeight;
+  size_t totalCars;
+  int margin = 0;
+  std::vector<size_t> hosts;  // process running each band
+  std::vector<sWorker> workers;
+  std::vector<std::vector<sLogEntry>> logs;
+  std::vector<long> checkpointTicks;  // the last checkpoint each worker confirmed, 0 for none
+  std::string checkpointPrefix;
+  std::vector<sCarRecord> pending;  // cars not handed to a band yet
+  sBand local;
+  sSimulationFrame frame;
+
+  static sCarRecord createRecord(const sCarStore &cars, size_t i, uint32_t id, bool withTanks) {
+    sCarRecord record;
+    record.id = id;
+    record.x = cars.x[i];
+    record.y = cars.y[i];
+    record.size = cars.sizes[i];
+    record.direction = cars.directions[i];
+    record.speed = cars.speeds[i];
+    record.flags = cars.flags[i];
+    record.kind = cars.kinds[i];
+    if (withTanks)
+      record.tanks = getCarTanks(cars, i);
+    return record;
+  }
+
+  static void appendRecord(sCarStore &cars, const sCarRecord &record, sCar *handle) {
+    cars.push_back(handle);
+    size_t i = cars.size() - 1;
+    cars.moveTo(i, sVec(record.x, record.y));
+    cars.sizes[i] = record.size;
+    cars.directions[i] = record.direction;
+    cars.speeds[i] = record.speed;
+    cars.flags[i] = record.flags;
+    cars.kinds[i] = static_cast<eCarKind>(record.kind);
+  }
+
+  static void moveCar(sCarStore &cars, size_t from, size_t to) {
+    cars.x[to] = cars.x[from];
+    cars.y[to] = cars.y[from];
+    cars.sizes[to] = cars.sizes[from];
+    cars.directions[to] = cars.directions[from];
+    cars.speeds[to] = cars.speeds[from];
+    cars.flags[to] = cars.flags[from];
+    cars.kinds[to] = cars.kinds[from];
+    cars.crossings[to] = -1;
+    cars.crossingSlots[to] = -1;
+    cars.handles[to] = cars.handles[from];
+  }
+
+  static void resizeCars(sCarStore &cars, size_t count) {
+    cars.x.resize(count);
+    cars.y.resize(count);
+    cars.sizes.resize(count);
+    cars.directions.resize(count);
+    cars.speeds.resize(count);
+    cars.flags.resize(count);
+    cars.kinds.resize(count);
+    cars.crossings.resize(count);
+    cars.crossingSlots.resize(count);
+    cars.handles.resize(count);
+  }
+
+  // The first band keeps the road's stream, so one process runs as simulateTick does
+  static sRandom bandRandom(const sRandom &random, size_t region) {
+    sRandom parent = random, band = random;
+    for (size_t i = 0; i < region; ++i) {
+      band = parent.split();
+    }
+    return band;
+  }
+
+  // The road without its cars
+  static sRoadData createBandRoad(const sRoadData &roadData, size_t region) {
+    std::vector<sCrossing> crossings;
+    for (auto &crossing : roadData.crossings) {
+      crossings.emplace_back(crossing.rect);
+    }
+    sRoadData band(roadData.laneSize, roadData.roadSegments, std::move(crossings), roadData.crossingSegments);
+    band.spawns = roadData.spawns;
+    band.random = bandRandom(roadData.random, region);
+    return band;
+  }
+
+  size_t regionOf(int x) const {
+    int64_t band = static_cast<int64_t>(x) * static_cast<int64_t>(regions.size()) / fieldWidth;
+    return static_cast<size_t>(std::min<int64_t>(std::max<int64_t>(band, 0), regions.size() - 1));
+  }
+
+  // Whether a car at x is within the margin of a band run by another process than host
+  bool nearOtherHost(int x, size_t host) const {
+    for (size_t region = regionOf(x - margin); region <= regionOf(x + margin); ++region) {
+      if (hosts[region] != host)
+        return true;
+    }
+    return false;
+  }
+
+  // The records of the own cars of the process that leave its bands, then of those near their edges
+  void collectOutgoing(size_t host, std::vector<bool> &leaving, sOutgoingHeader &header, std::vector<sCarRecord> &records) const {
+    const sCarStore &cars = local.road.cars;
+    leaving.assign(local.ownCount, false);
+    header.ownCars = static_cast<uint32_t>(local.ownCount);
+    for (size_t i = 0; i < local.ownCount; ++i) {
+      if (hosts[regionOf(cars.x[i])] != host) {
+        leaving[i] = true;
+        records.push_back(createRecord(cars, i, local.ids[i], true));
+      }
+    }
+    header.leaving = static_cast<uint32_t>(records.size());
+    for (size_t i = 0; i < local.ownCount; ++i) {
+      if (!leaving[i] && nearOtherHost(cars.x[i], host))
+        records.push_back(createRecord(cars, i, local.ids[i], false));
+    }
+    header.borders = static_cast<uint32_t>(records.size()) - header.leaving;
+  }
+
+  // Sends records [first, last) as ghosts to the hosts around them but their owner, first handing them to the host of their band for HAND_OVER
+  void route(const std::vector<sCarRecord> &records, size_t first, size_t last, size_t owner, std::vector<std::vector<sCarRecord>> &arrivals,
+             std::vector<std::vector<sCarRecord>> &ghosts) {
+    const bool handOver = owner == HAND_OVER;
+    std::vector<bool> sent(regions.size());
+    for (size_t r = first; r < last; ++r) {
+      const sCarRecord &record = records[r];
+      if (handOver) {
+        owner = hosts[regionOf(record.x)];
+        arrivals[owner].push_back(record);
+        if (owner != 0)
+          logs[owner].push_back(sLogEntry{true, record});
+      }
+      std::fill(sent.begin(), sent.end(), false);
+      for (size_t region = regionOf(record.x - margin); region <= regionOf(record.x + margin); ++region) {
+        size_t host = hosts[region];
+        if (host != owner && !sent[host]) {
+          sent[host] = true;
+          ghosts[host].push_back(record);
+        }
+      }
+    }
+  }
+
+  void routeOutgoing(size_t host, const sOutgoingHeader &header, const std::vector<sCarRecord> &records, std::vector<std::vector<sCarRecord>> &arrivals,
+                     std::vector<std::vector<sCarRecord>> &ghosts) {
+    for (size_t r = 0; r < header.leaving; ++r) {
+      ++regions[regionOf(records[r].x)].arrivals;
+      if (host != 0)
+        logs[host].push_back(sLogEntry{false, records[r]});
+    }
+    route(records, 0, header.leaving, HAND_OVER, arrivals, ghosts);
+    route(records, header.leaving, records.size(), host, arrivals, ghosts);
+  }
+
+  // A write to a failed peer reports an error instead of raising SIGPIPE
+  static bool sendAll(int fd, const void *data, size_t size) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;
+#else
+    const int flags = 0;
+#endif
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+      ssize_t sent = send(fd, bytes, size, flags);
+      if (sent < 0 && errno == EINTR)
+        continue;
+      if (sent <= 0)
+        return false;
+      bytes += sent;
+      size -= static_cast<size_t>(sent);
+    }
+    return true;
+  }
+
+  // Fails on a closed peer and, on the coordinator's sockets, on one past the timeout
+  static bool receiveAll(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+      ssize_t received = read(fd, bytes, size);
+      if (received < 0 && errno == EINTR)
+        continue;
+      if (received <= 0)
+        return false;
+      bytes += received;
+      size -= static_cast<size_t>(received);
+    }
+    return true;
+  }
+
+  static bool sendRecords(int fd, const std::vector<sCarRecord> &records) { return sendAll(fd, records.data(), records.size() * sizeof(sCarRecord)); }
+
+  // Fails on more records than the road has cars or any that isn't one of them
+  bool receiveRecords(int fd, size_t count, std::vector<sCarRecord> &records) const {
+    if (count > totalCars)
+      return false;
+    size_t before = records.size();
+    records.resize(before + count);
+    if (!receiveAll(fd, records.data() + before, count * sizeof(sCarRecord)))
+      return false;
+    for (size_t i = before; i < records.size(); ++i) {
+      if (records[i].id >= totalCars || records[i].kind >= CAR_KIND_COUNT)
+        return false;
+    }
+    return true;
+  }
+
+  bool receiveOutgoing(int fd, sOutgoingHeader &header, std::vector<sCarRecord> &records) const {
+    return receiveAll(fd, &header, sizeof(header)) && header.leaving <= totalCars && header.borders <= totalCars && header.ownCars <= totalCars &&
+           receiveRecords(fd, size_t(header.leaving) + header.borders, records);
+  }
+
+  static bool sendIncoming(int fd, const std::vector<sCarRecord> &arrivals, const std::vector<sCarRecord> &ghosts) {
+    sIncomingHeader header{static_cast<uint32_t>(arrivals.size()), static_cast<uint32_t>(ghosts.size())};
+    return sendAll(fd, &header, sizeof(header)) && sendRecords(fd, arrivals) && sendRecords(fd, ghosts);
+  }
+
+  void forkWorker(const sRoadData &roadData, size_t region, int timeoutMs) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+      throw std::runtime_error("Can't create a socket pair for a worker");
+#ifdef SO_NOSIGPIPE
+    // no MSG_NOSIGNAL here, so a write to a closed socket is kept from raising SIGPIPE this way
+    int noSigPipe = 1;
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+    setsockopt(fds[1], SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+    // a worker that hangs fails the coordinator's reads and writes instead of stalling them
+    timeval timeout{timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+    setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      throw std::runtime_error("Can't fork a worker");
+    }
+    if (pid == 0) {
+      close(fds[0]);
+      for (auto &worker : workers) {
+        close(worker.fd);
+      }
+      runWorker(fds[1], region, roadData);
+    }
+    close(fds[1]);
+    workers.push_back(sWorker{pid, fds[0]});
+  }
+
+  std::string checkpointPath(size_t region, long tick) const { return checkpointPrefix + std::to_string(region) + "_" + std::to_string(tick); }
+
+  void removeCheckpoint(size_t region, long tick) const {
+    std::remove(checkpointPath(region, tick).c_str());
+    std::remove((checkpointPath(region, tick) + ".tmp").c_str());
+  }
+
+  // The confirmed checkpoint and the next one, which a failed worker may have left unconfirmed
+  void removeCheckpoints(size_t region) const {
+    removeCheckpoint(region, checkpointTicks[region]);
+    removeCheckpoint(region, checkpointTicks[region] + CHECKPOINT_TICKS);
+  }
+
+  void writeCheckpoint(size_t region, long tick) const {
+    std::string path = checkpointPath(region, tick);
+    std::FILE *file = std::fopen((path + ".tmp").c_str(), "wb");
+    if (file == nullptr)
+      throw std::runtime_error("Can't write checkpoint " + path);
+    std::vector<sCarRecord> records;
+    for (size_t i = 0; i < local.ownCount; ++i) {
+      records.push_back(createRecord(local.road.cars, i, local.ids[i], true));
+    }
+    uint64_t count = records.size();
+    bool written = std::fwrite(&count, sizeof(count), 1, file) == 1 && std::fwrite(records.data(), sizeof(sCarRecord), records.size(), file) == records.size();
+    if (std::fclose(file) != 0 || !written || std::rename((path + ".tmp").c_str(), path.c_str()) != 0)
+      throw std::runtime_error("Can't write checkpoint " + path);
+  }
+
+  // The cars of the failed worker's band from its checkpoint and the hand-overs logged since, run by the coordinator from now on
+  void takeOver(size_t region, std::vector<sCarRecord> &adopted) {
+    sWorker &worker = workers[region - 1];
+    regions[region].alive = false;
+    close(worker.fd);
+    kill(worker.pid, SIGKILL);
+    hosts[region] = 0;
+
+    std::vector<sCarRecord> records;
+    std::map<uint32_t, sCarRecord> cars;
+    if (checkpointTicks[region] != 0) {
+      std::string path = checkpointPath(region, checkpointTicks[region]);
+      std::FILE *file = std::fopen(path.c_str(), "rb");
+      uint64_t count = 0;
+      bool read = file != nullptr && std::fread(&count, sizeof(count), 1, file) == 1 && count <= totalCars;
+      if (read) {
+        records.resize(count);
+        read = std::fread(records.data(), sizeof(sCarRecord), records.size(), file) == records.size();
+      }
+      if (file != nullptr)
+        std::fclose(file);
+      if (!read)
+        throw std::runtime_error("Can't read checkpoint " + path);
+    }
+    removeCheckpoints(region);
+    for (auto &record : records) {
+      if (record.id >= totalCars || record.kind >= CAR_KIND_COUNT)
+        throw std::runtime_error("Bad checkpoint of band " + std::to_string(region));
+      cars[record.id] = record;
+    }
+    for (auto &entry : logs[region]) {
+      if (entry.arrived)
+        cars[entry.record.id] = entry.record;
+      else
+        cars.erase(entry.record.id);
+    }
+    logs[region].clear();
+    for (auto &car : cars) {
+      adopted.push_back(car.second);
+    }
+  }
+
+  // The worker's side, on its band, until stopped or the coordinator is gone
+  [[noreturn]] void runWorker(int fd, size_t region, const sRoadData &roadData) {
+    int status = 0;
+    try {
+      local.road.random = bandRandom(roadData.random, region);
+      serveCoordinator(fd, region);
+    } catch (...) {
+      status = 1;
+    }
+    close(fd);
+    // the coordinator's other state is left to the OS
+    _exit(status);
+  }
+
+  void serveCoordinator(int fd, size_t region) {
+    std::vector<bool> leaving;
+    std::vector<sCarRecord> records, arrivals, ghosts;
+    long tick = 0, checkpointTick = 0;
+    uint32_t command = STOP;
+    while (receiveAll(fd, &command, sizeof(command))) {
+      if (command == GATHER) {
+        sOutgoingHeader header;
+        records.clear();
+        for (size_t i = 0; i < local.ownCount; ++i) {
+          records.push_back(createRecord(local.road.cars, i, local.ids[i], true));
+        }
+        header.leaving = static_cast<uint32_t>(records.size());
+        if (!sendAll(fd, &header, sizeof(header)) || !sendRecords(fd, records))
+          return;
+        continue;
+      }
+      if (command != TICK)
+        return;
+
+      sOutgoingHeader header;
+      records.clear();
+      collectOutgoing(region, leaving, header, records);
+      header.checkpointTick = checkpointTick;
+      if (!sendAll(fd, &header, sizeof(header)) || !sendRecords(fd, records))
+        return;
+      sIncomingHeader incoming;
+      arrivals.clear();
+      ghosts.clear();
+      if (!receiveAll(fd, &incoming, sizeof(incoming)) || !receiveRecords(fd, incoming.arrivals, arrivals) || !receiveRecords(fd, incoming.ghosts, ghosts))
+        return;
+      local.apply(leaving, arrivals, ghosts);
+      simulateTick(local.road, frame, fieldWidth, fieldHeight);
+      if (++tick % CHECKPOINT_TICKS == 0) {
+        writeCheckpoint(region, tick);
+        checkpointTick = tick;
+      }
+    }
+  }
+};
+
+#endif  // _WIN32
+
+#endif  // MYTONA_DISTRIBUTED_HPP
@@ -0,0 +1,221 @@
+#ifndef MYTONA_EVENTS_HPP
+#define MYTONA_EVENTS_HPP
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include "structs.hpp"
+#include "simulator.hpp"
+
+// Event-driven stepping on top of the tick pipeline. Motion is axis aligned
+// with constant integer speeds, so until its next event a car only moves by
+// its speed each tick, and when that holds for every car the ticks up to the
+// earliest event are skipped by moving all cars at once. A car's events are
+//  - the crossing it contacts changing, or a car crossing its way in there,
+//  - entering or leaving the field,
+//  - another car in its way: its rect stretched forward by its length or speed,
+//    whichever is longer, meeting another such rect,
+//  - being the debuggee, which prints every tick.
+// Respawns draw from the shared random stream and collisions are resolved in
+// index order, so a tick with any event runs the whole road through simulateTick.
+
+// Offsets k >= 0 for which a condition linear in k holds, [first, last]
+struct sOffsets {
+  static constexpr int64_t NEVER = INT64_MAX / 4;
+  int64_t first, last;
+
+  bool empty() const { return first > last; }
+
+  sOffsets intersect(const sOffsets &other) const { return sOffsets{std::max(first, other.first), std::min(last, other.last)}; }
+
+  // a + k * d <= 0, or < 0 when strict
+  static sOffsets whereNotPositive(int64_t a, int64_t d, bool strict) {
+    if (strict)
+      a += 1;
+    if (d == 0)
+      return a <= 0 ? sOffsets{0, NEVER} : sOffsets{1, 0};
+    if (d > 0)
+      return sOffsets{0, floorDiv(-a, d)};
+    return sOffsets{std::max<int64_t>(0, -floorDiv(-a, -d)), NEVER};
+  }
+
+  // Rects moving by va and vb per tick overlap (strict) or contact each other
+  static sOffsets whereMeeting(const sRect &a, const sVec &va, const sRect &b, const sVec &vb, bool strict) {
+    int64_t dx = va.x - vb.x, dy = va.y - vb.y;
+    return whereNotPositive(a.p1.x - b.p2.x, dx, strict)      //
+        .intersect(whereNotPositive(b.p1.x - a.p2.x, -dx, strict))  //
+        .intersect(whereNotPositive(a.p1.y - b.p2.y, dy, strict))   //
+        .intersect(whereNotPositive(b.p1.y - a.p2.y, -dy, strict));
+  }
+
+ private:
+  static int64_t floorDiv(int64_t a, int64_t b) { return a / b - ((a % b != 0) && ((a < 0) != (b < 0))); }
+};
+
+struct sEventEngine {
+  enum : int64_t { MAX_QUIET_TICKS = 1 << 16 };
+  enum : long { MAX_BACKOFF = 8 };
+
+  int fieldWidth, fieldHeight;
+  long skippedTicks = 0, steppedTicks = 0;
+
+  sEventEngine(int fieldWidth, int fieldHeight) : fieldWidth(fieldWidth), fieldHeight(fieldHeight) {}
+
+  // Same road as after that many simulateTick calls. Quiet ticks found once
+  // are used up across calls, so the road must not change in between.
+  void advance(sRoadData &roadData, sSimulationFrame &frame, long ticks) {
+    while (ticks > 0) {
+      if (quietTicks == 0 && untilNextSearch == 0) {
+        quietTicks = findQuietTicks(roadData);
+        // on a busy road most searches find nothing, look less often then
+        untilNextSearch = quietTicks == 0 ? backoff : 0;
+        backoff = quietTicks == 0 ? std::min(backoff * 2, static_cast<long>(MAX_BACKOFF)) : 1;
+      }
+
+      if (quietTicks > 0) {
+        long skipped = static_cast<long>(std::min<int64_t>(quietTicks, ticks));
+        auto &cars = roadData.cars;
+        for (size_t i = 0; i < cars.size(); ++i) {
+          cars.moveBy(i, cars.directions[i] * (cars.speeds[i] * static_cast<int>(skipped)));
+        }
+        quietTicks -= skipped;
+        skippedTicks += skipped;
+        ticks -= skipped;
+        continue;
+      }
+
+      simulateTick(roadData, frame, fieldWidth, fieldHeight);
+      ++steppedTicks;
+      --ticks;
+      if (untilNextSearch > 0)
+        --untilNextSearch;
+    }
+  }
+
+  // Ticks from now in which every car just moves by its speed
+  int64_t findQuietTicks(const sRoadData &roadData) {
+    const sCarStore &cars = roadData.cars;
+    const sRect field(fieldWidth, fieldHeight);
+    const sVec still(0, 0);
+    int64_t quiet = MAX_QUIET_TICKS;
+    // offset k is the state tick k + 1 starts from, so an event at k leaves k quiet ticks
+    auto eventAt = [&](int64_t offset) { quiet = std::min(quiet, offset); };
+
+    for (size_t i = 0; i < cars.size() && quiet > 0; ++i) {
+      if (cars.hasFlag(i, sCarStore::DEBUGGEE))
+        return 0;
+      sRect rect = cars.rect(i);
+      sVec velocity = cars.directions[i] * cars.speeds[i];
+
+      int crossing = cars.crossings[i];
+      if (crossing >= 0) {
+        if (hasCrossTraffic(cars, roadData.crossings[crossing]))
+          return 0;
+        sOffsets contact = sOffsets::whereMeeting(rect, velocity, roadData.crossings[crossing].rect, still, false);
+        eventAt(contact.empty() || contact.first > 0 ? 0 : contact.last + 1);
+      }
+      // only crossings along the way the car goes in the ticks still quiet can be contacted
+      roadData.crossingIndex.forEachNear(sweep(rect, velocity, quiet), cars.directions[i], roadData.crossings, [&](size_t c) {
+        if (static_cast<int>(c) == crossing)
+          return;
+        sOffsets contact = sOffsets::whereMeeting(rect, velocity, roadData.crossings[c].rect, still, false);
+        if (!contact.empty())
+          eventAt(contact.first);
+      });
+
+      sOffsets inField = sOffsets::whereMeeting(rect, velocity, field, still, false);
+      if (!cars.hasFlag(i, sCarStore::WAS_IN_FIELD)) {
+        if (!inField.empty())
+          eventAt(inField.first);
+      } else {
+        eventAt(inField.empty() || inField.first > 0 ? 0 : inField.last + 1);
+      }
+    }
+    if (quiet > 0)
+      eventAt(findFirstMeeting(cars, quiet));
+    return quiet;
+  }
+
+ private:
+  struct sSweptCar {
+    int64_t x1, x2, y1, y2;
+    sRect reach;
+    sVec velocity;
+  };
+
+  int64_t quietTicks = 0;
+  long untilNextSearch = 0;
+  long backoff = 1;
+  std::vector<sSweptCar> swept;
+
+  // Side checks and deadlocks only look at cars going across each other
+  static bool hasCrossTraffic(const sCarStore &cars, const sCrossing &crossing) {
+    bool horizontal = false, vertical = false;
+    for (auto car : crossing.cars) {
+      (cars.directions[car].x != 0 ? horizontal : vertical) = true;
+    }
+    return horizontal && vertical;
+  }
+
+  // The rect with every place it moves through in that many ticks
+  static sRect sweep(sRect rect, const sVec &velocity, int64_t ticks) {
+    int dx = static_cast<int>(velocity.x * ticks), dy = static_cast<int>(velocity.y * ticks);
+    (dx > 0 ? rect.p2.x : rect.p1.x) += dx;
+    (dy > 0 ? rect.p2.y : rect.p1.y) += dy;
+    return rect;
+  }
+
+  // The rect with its forward and future rects, which decisions and collisions test against other cars
+  static sRect reachOf(const sCarStore &cars, size_t i) {
+    sRect reach = cars.rect(i);
+    const sVec &direction = cars.directions[i];
+    int stretch = std::max(cars.speeds[i], direction.x != 0 ? reach.width() : reach.height());
+    if (direction.x > 0)
+      reach.p2.x += stretch;
+    if (direction.x < 0)
+      reach.p1.x -= stretch;
+    if (direction.y > 0)
+      reach.p2.y += stretch;
+    if (direction.y < 0)
+      reach.p1.y -= stretch;
+    return reach;
+  }
+
+  // Earliest offset below the limit at which two cars' reaches overlap. Only
+  // pairs whose reaches swept over the limit overlap are tested, found with a
+  // sort-and-sweep along x.
+  int64_t findFirstMeeting(const sCarStore &cars, int64_t limit) {
+    swept.clear();
+    for (size_t i = 0; i < cars.size(); ++i) {
+      sRect reach = reachOf(cars, i);
+      sVec velocity = cars.directions[i] * cars.speeds[i];
+      int64_t dx = velocity.x * limit, dy = velocity.y * limit;
+      swept.push_back(sSweptCar{std::min<int64_t>(reach.p1.x, reach.p1.x + dx), std::max<int64_t>(reach.p2.x, reach.p2.x + dx),
+                                std::min<int64_t>(reach.p1.y, reach.p1.y + dy), std::max<int64_t>(reach.p2.y, reach.p2.y + dy), reach, velocity});
+    }
+    std::sort(swept.begin(), swept.end(), [](const sSweptCar &a, const sSweptCar &b) { return a.x1 < b.x1; });
+
+    for (size_t a = 0; a < swept.size(); ++a) {
+      for (size_t b = a + 1; b < swept.size() && swept[b].x1 < swept[a].x2; ++b) {
+        if (swept[b].y1 >= swept[a].y2 || swept[a].y1 >= swept[b].y2)
+          continue;
+        sOffsets meeting = sOffsets::whereMeeting(swept[a].reach, swept[a].velocity, swept[b].reach, swept[b].velocity, true);
+        if (!meeting.empty() && meeting.first < limit) {
+          limit = meeting.first;
+          if (limit == 0)
+            return 0;
+        }
+      }
+    }
+    return limit;
+  }
+};
+
+// Whether two roads are in the same simulation state, for checking the event engine against plain ticks
+bool sameRoadState(const sRoadData &a, const sRoadData &b) {
+  const sCarStore &carsA = a.cars, &carsB = b.cars;
+  return carsA.x == carsB.x && carsA.y == carsB.y && carsA.directions == carsB.directions && carsA.speeds == carsB.speeds && carsA.flags == carsB.flags &&
+         carsA.crossings == carsB.crossings && carsA.crossingSlots == carsB.crossingSlots && std::equal(std::begin(a.random.state), std::end(a.random.state), std::begin(b.random.state));
+}
+
+#endif  // MYTONA_EVENTS_HPP
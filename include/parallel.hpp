@@ -0,0 +1,165 @@
+#ifndef MYTONA_PARALLEL_HPP
+#define MYTONA_PARALLEL_HPP
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+
+static constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Fixed set of worker threads running one index range at a time. The caller
+// thread takes chunks too, so a pool with no workers simply runs inline.
+// Jobs are passed as a function pointer plus context rather than a
+// std::function, so dispatching one never allocates.
+class sThreadPool {
+ private:
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  bool stopping = false;
+  size_t generation = 0;
+  size_t busyWorkers = 0;
+
+  void (*job)(void *context, size_t begin, size_t end) = nullptr;
+  void *jobContext = nullptr;
+  size_t jobCount = 0;
+  size_t jobChunk = 1;
+  std::atomic<size_t> nextChunk{0};
+
+  template <typename F>
+  static void invoke(void *context, size_t begin, size_t end) {
+    (*static_cast<F *>(context))(begin, end);
+  }
+
+  void runChunks() {
+    while (true) {
+      size_t begin = nextChunk.fetch_add(jobChunk);
+      if (begin >= jobCount)
+        break;
+      job(jobContext, begin, std::min(begin + jobChunk, jobCount));
+    }
+  }
+
+  void workerLoop() {
+    size_t seenGeneration = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        wake.wait(lock, [&] { return stopping || generation != seenGeneration; });
+        if (stopping)
+          return;
+        seenGeneration = generation;
+      }
+      runChunks();
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--busyWorkers == 0)
+          done.notify_one();
+      }
+    }
+  }
+
+ public:
+  explicit sThreadPool(size_t workersCount) {
+    workers.reserve(workersCount);
+    for (size_t i = 0; i < workersCount; ++i) {
+      workers.emplace_back([this] { workerLoop(); });
+    }
+  }
+
+  ~sThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers) {
+      worker.join();
+    }
+  }
+
+  sThreadPool(const sThreadPool &) = delete;
+  sThreadPool &operator=(const sThreadPool &) = delete;
+
+  // Threads that take part in a job, the calling one included
+  size_t concurrency() const { return workers.size() + 1; }
+
+  // Calls fn(begin, end) over [0, count) in chunks of chunkSize and returns once all are done
+  template <typename F>
+  void parallelFor(size_t count, size_t chunkSize, F fn) {
+    if (count == 0)
+      return;
+    if (workers.empty() || count <= chunkSize) {
+      fn(0, count);
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      job = &invoke<F>;
+      jobContext = &fn;
+      jobCount = count;
+      jobChunk = chunkSize;
+      nextChunk = 0;
+      busyWorkers = workers.size();
+      ++generation;
+    }
+    wake.notify_all();
+    runChunks();
+
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [&] { return busyWorkers == 0; });
+    job = nullptr;
+    jobContext = nullptr;
+  }
+};
+
+// Chunk size for writing elements of the given size from several threads: a
+// whole number of cache lines, so two chunks share at most the line their
+// boundary falls in, and a few chunks per thread so uneven work still balances
+size_t cacheAlignedChunk(size_t count, size_t elementSize, size_t threads) {
+  size_t perLine = std::max<size_t>(1, CACHE_LINE_SIZE / elementSize);
+  size_t chunk = count / (threads * 4) + 1;
+  chunk = std::max<size_t>(chunk, 256);
+  return (chunk + perLine - 1) / perLine * perLine;
+}
+
+// Hands the latest of a stream of values from one producer thread to one
+// consumer thread without locks or waiting. Each side owns one of three
+// slots and the third is swapped through an atomic, so the producer never
+// overwrites what the consumer reads and the consumer skips values it was
+// too slow for. Slots keep their storage, so reused values don't allocate.
+template <typename T>
+class sTripleBuffer {
+ private:
+  enum : unsigned { INDEX_MASK = 3, FRESH = 4 };
+
+  T slots[3];
+  unsigned writing = 0, reading = 1;
+  // the slot in between, with FRESH set when it holds a value not yet read
+  std::atomic<unsigned> middle{2};
+
+ public:
+  // The producer's slot, filled before publish
+  T &back() { return slots[writing]; }
+
+  void publish() { writing = middle.exchange(writing | FRESH, std::memory_order_acq_rel) & INDEX_MASK; }
+
+  // Takes the latest published value into the consumer's slot, false when there was none since the last take
+  bool acquire() {
+    if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+      return false;
+    reading = middle.exchange(reading, std::memory_order_acq_rel) & INDEX_MASK;
+    return true;
+  }
+
+  // The consumer's slot, valid until the next acquire
+  T &front() { return slots[reading]; }
+};
+
+#endif  // MYTONA_PARALLEL_HPP
@@ -0,0 +1,208 @@
+#ifndef MYTONA_PROFILER_HPP
+#define MYTONA_PROFILER_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <chrono>
+
+// Stage timings of the main loop. The PROFILE_* macros expand to nothing
+// unless SIM_PROFILE is defined, so a normal build carries no clock reads.
+// SIM_PROFILE_INTERVAL=<seconds> also reports every so often and
+// SIM_PROFILE_CSV=<path> writes CSV rows instead of the stdout table.
+
+enum eProfileStage {
+  PROFILE_RESOLVE_COLLISIONS,
+  PROFILE_RESPAWN_OUT_OF_FIELD_CARS,
+  PROFILE_GET_VERBOSE_CARS_INFO,
+  PROFILE_GET_NEXT_CARS_POSITION_PAIRS,
+  PROFILE_RESOLVE_DEADLOCKS,
+  PROFILE_HANDLE_MOVINGS,
+  PROFILE_SIMULATE_TICK,
+  PROFILE_DRAW_ROAD_DATA,
+  PROFILE_STAGE_COUNT
+};
+
+static const char *profileStageNames[PROFILE_STAGE_COUNT] = {
+    "resolveCollisions",         //
+    "respawnOutOfFieldCars",     //
+    "getVerboseCarsInfo",        //
+    "getNextCarsPositionPairs",  //
+    "resolveDeadlocks",          //
+    "handleMovings",             //
+    "simulateTick",              //
+    "drawRoadData",              //
+};
+
+// Log-linear histogram of nanosecond durations in the spirit of HdrHistogram:
+// values below SUB_BUCKETS are exact and above that every power of two is
+// split into SUB_BUCKETS / 2 buckets, so any value is off by under 1/32.
+struct sLatencyHistogram {
+  enum : unsigned { SUB_BUCKET_BITS = 6, SUB_BUCKETS = 1u << SUB_BUCKET_BITS, BUCKETS = SUB_BUCKETS + (64 - SUB_BUCKET_BITS) * SUB_BUCKETS / 2 };
+
+  uint64_t counts[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t max = 0;
+
+  static unsigned bucketOf(uint64_t value) {
+    if (value < SUB_BUCKETS)
+      return static_cast<unsigned>(value);
+    unsigned magnitude = 63 - __builtin_clzll(value);
+    unsigned shift = magnitude - SUB_BUCKET_BITS + 1;
+    return SUB_BUCKETS + (shift - 1) * SUB_BUCKETS / 2 + static_cast<unsigned>((value >> shift) - SUB_BUCKETS / 2);
+  }
+
+  // Highest value that falls in the bucket
+  static uint64_t bucketTop(unsigned bucket) {
+    if (bucket < SUB_BUCKETS)
+      return bucket;
+    unsigned shift = (bucket - SUB_BUCKETS) / (SUB_BUCKETS / 2) + 1;
+    uint64_t top = (bucket - SUB_BUCKETS) % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+    return ((top + 1) << shift) - 1;
+  }
+
+  void record(uint64_t value) {
+    ++counts[bucketOf(value)];
+    ++count;
+    if (value > max)
+      max = value;
+  }
+
+  // Smallest recorded value that at least the given fraction of values don't exceed
+  uint64_t percentile(double fraction) const {
+    if (count == 0)
+      return 0;
+    uint64_t rank = static_cast<uint64_t>(fraction * count + 0.5);
+    rank = rank < 1 ? 1 : rank > count ? count : rank;
+    uint64_t seen = 0;
+    for (unsigned bucket = 0; bucket < BUCKETS; ++bucket) {
+      seen += counts[bucket];
+      if (seen >= rank)
+        return bucketTop(bucket) < max ? bucketTop(bucket) : max;
+    }
+    return max;
+  }
+
+  void merge(const sLatencyHistogram &other) {
+    for (unsigned bucket = 0; bucket < BUCKETS; ++bucket) {
+      counts[bucket] += other.counts[bucket];
+    }
+    count += other.count;
+    if (other.max > max)
+      max = other.max;
+  }
+
+  void clear() { *this = sLatencyHistogram(); }
+};
+
+struct sProfiler {
+  typedef std::chrono::steady_clock sClock;
+
+  // Since the last interval report, and over the whole run
+  sLatencyHistogram recent[PROFILE_STAGE_COUNT];
+  sLatencyHistogram total[PROFILE_STAGE_COUNT];
+
+  double reportIntervalSeconds = 0;
+  std::FILE *csv = nullptr;
+  sClock::time_point startedAt = sClock::now();
+  sClock::time_point lastReportAt = startedAt;
+
+  sProfiler() {
+    if (const char *interval = std::getenv("SIM_PROFILE_INTERVAL"))
+      reportIntervalSeconds = std::atof(interval);
+    if (const char *path = std::getenv("SIM_PROFILE_CSV")) {
+      csv = std::fopen(path, "w");
+      if (csv != nullptr)
+        std::fprintf(csv, "elapsed_s,scope,stage,count,p50_ns,p99_ns,p999_ns,max_ns\n");
+    }
+  }
+
+  ~sProfiler() {
+    if (csv != nullptr)
+      std::fclose(csv);
+  }
+
+  sProfiler(const sProfiler &) = delete;
+  sProfiler &operator=(const sProfiler &) = delete;
+
+  void record(eProfileStage stage, sClock::duration duration) { recent[stage].record(std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()); }
+
+  // Called once per frame; reports the last interval once it is long enough
+  void endFrame() {
+    if (reportIntervalSeconds <= 0)
+      return;
+    sClock::time_point now = sClock::now();
+    if (std::chrono::duration<double>(now - lastReportAt).count() < reportIntervalSeconds)
+      return;
+    lastReportAt = now;
+    report(recent, "interval");
+    foldRecent();
+  }
+
+  // Whole-run percentiles, at exit
+  void reportTotal() {
+    foldRecent();
+    report(total, "total");
+  }
+
+ private:
+  void foldRecent() {
+    for (int stage = 0; stage < PROFILE_STAGE_COUNT; ++stage) {
+      total[stage].merge(recent[stage]);
+      recent[stage].clear();
+    }
+  }
+
+  void report(const sLatencyHistogram *histograms, const char *scope) {
+    double elapsed = std::chrono::duration<double>(sClock::now() - startedAt).count();
+    if (csv == nullptr)
+      std::printf("%s profile at %.1f s\n%-26s %10s %10s %10s %10s %10s\n", scope, elapsed, "stage (us)", "count", "p50", "p99", "p99.9", "max");
+
+    for (int stage = 0; stage < PROFILE_STAGE_COUNT; ++stage) {
+      const sLatencyHistogram &histogram = histograms[stage];
+      if (histogram.count == 0)
+        continue;
+      unsigned long long p50 = histogram.percentile(0.5), p99 = histogram.percentile(0.99), p999 = histogram.percentile(0.999);
+      if (csv != nullptr) {
+        std::fprintf(csv, "%.3f,%s,%s,%llu,%llu,%llu,%llu,%llu\n", elapsed, scope, profileStageNames[stage], static_cast<unsigned long long>(histogram.count), p50, p99, p999,
+                     static_cast<unsigned long long>(histogram.max));
+      } else {
+        std::printf("%-26s %10llu %10.1f %10.1f %10.1f %10.1f\n", profileStageNames[stage], static_cast<unsigned long long>(histogram.count), p50 / 1e3, p99 / 1e3, p999 / 1e3,
+                    histogram.max / 1e3);
+      }
+    }
+    if (csv != nullptr)
+      std::fflush(csv);
+  }
+};
+
+// Records the lifetime of the scope as one sample of the stage; a null profiler records nothing
+struct sProfileScope {
+  sProfiler *profiler;
+  eProfileStage stage;
+  sProfiler::sClock::time_point start;
+
+  sProfileScope(sProfiler *profiler, eProfileStage stage) : profiler(profiler), stage(stage) {
+    if (profiler != nullptr)
+      start = sProfiler::sClock::now();
+  }
+
+  ~sProfileScope() {
+    if (profiler != nullptr)
+      profiler->record(stage, sProfiler::sClock::now() - start);
+  }
+};
+
+#ifdef SIM_PROFILE
+#define PROFILE_CONCAT_INNER(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_INNER(a, b)
+#define PROFILE_SCOPE(profiler, stage) sProfileScope PROFILE_CONCAT(profileScope, __LINE__)(profiler, stage)
+#define PROFILE_END_FRAME(profiler) (profiler).endFrame()
+#define PROFILE_REPORT(profiler) (profiler).reportTotal()
+#else
+#define PROFILE_SCOPE(profiler, stage) ((void)0)
+#define PROFILE_END_FRAME(profiler) ((void)0)
+#define PROFILE_REPORT(profiler) ((void)0)
+#endif
+
+#endif  // MYTONA_PROFILER_HPP
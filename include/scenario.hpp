@@ -0,0 +1,179 @@
+#ifndef MYTONA_SCENARIO_HPP
+#define MYTONA_SCENARIO_HPP
+
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <stdexcept>
+#include "structs.hpp"
+
+static constexpr int SCREEN_WIDTH = 640;
+static constexpr int SCREEN_HEIGHT = 480;
+static constexpr int CARS_COUNT = 20;
+static constexpr int ROAD_WIDTH = 40;
+static constexpr int CAR_SIZE_SMALL = 20;
+static constexpr int CAR_SIZE_BIG = 40;
+static constexpr int GRID_BLOCK_SIZE = 160;
+
+// Two roads crossing once, with a spawn at each road end
+sRoadData createDefaultRoadData(uint64_t seed) {
+  sVec roadSegment1_p1 = sVec(0, SCREEN_HEIGHT / 2);
+  sVec roadSegment1_p2 = sVec(SCREEN_WIDTH, SCREEN_HEIGHT / 2);
+  sVec roadSegment2_p1 = sVec(SCREEN_WIDTH / 3, SCREEN_HEIGHT);
+  sVec roadSegment2_p2 = sVec(SCREEN_WIDTH / 3, 0);
+  // sVec roadSegment3_p1 = sVec(2 * SCREEN_WIDTH / 3, SCREEN_HEIGHT);
+  // sVec roadSegment3_p2 = sVec(2 * SCREEN_WIDTH / 3, 0);
+
+  sRoadData roadData(ROAD_WIDTH, {
+                                 sLineSegment(roadSegment1_p1, roadSegment1_p2),  //
+                                 sLineSegment(roadSegment2_p1, roadSegment2_p2),  //
+                                 //  sLineSegment(roadSegment3_p1, roadSegment3_p2)   // FIXME: Deadlock checking doesn't work as expected
+                                 },
+                     seed);
+
+  roadData.createSpawn(roadSegment1_p1, eCarAlignment::CAR_MOVE_EAST, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  roadData.createSpawn(roadSegment1_p2, eCarAlignment::CAR_MOVE_WEST, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  roadData.createSpawn(roadSegment2_p1, eCarAlignment::CAR_MOVE_SOUTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  roadData.createSpawn(roadSegment2_p2, eCarAlignment::CAR_MOVE_NORTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  // roadData.createSpawn(roadSegment3_p1, eCarAlignment::CAR_MOVE_SOUTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  // roadData.createSpawn(roadSegment3_p2, eCarAlignment::CAR_MOVE_NORTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+
+  return roadData;
+}
+
+// Evenly spaced grid of columns x rows roads across a width x height field,
+// with a spawn at each road end
+sRoadData createGridRoadData(int columns, int rows, int width, int height, uint64_t seed) {
+  std::vector<sLineSegment> segments;
+  for (int row = 1; row <= rows; ++row) {
+    int y = height * row / (rows + 1);
+    segments.emplace_back(sVec(0, y), sVec(width, y));
+  }
+  for (int column = 1; column <= columns; ++column) {
+    int x = width * column / (columns + 1);
+    segments.emplace_back(sVec(x, height), sVec(x, 0));
+  }
+
+  sRoadData roadData(ROAD_WIDTH, segments, seed);
+  for (auto &segment : segments) {
+    bool horizontal = segment.p1.y == segment.p2.y;
+    roadData.createSpawn(segment.p1, horizontal ? eCarAlignment::CAR_MOVE_EAST : eCarAlignment::CAR_MOVE_SOUTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+    roadData.createSpawn(segment.p2, horizontal ? eCarAlignment::CAR_MOVE_WEST : eCarAlignment::CAR_MOVE_NORTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  }
+  return roadData;
+}
+
+// Reads a road from a text scenario, one statement per line, # starting a comment:
+//   field <width> <height>
+//   lane <size>
+//   segment <x1> <y1> <x2> <y2>
+//   spawn <x> <y> <east|west|north|south>
+// Spawns are given at road ends as for createSpawn. The field defaults to the screen.
+sRoadData loadScenario(const std::string &path, uint64_t seed, int &fieldWidth, int &fieldHeight) {
+  std::ifstream file(path);
+  if (!file)
+    throw std::runtime_error("Can't open scenario " + path);
+
+  int laneSize = ROAD_WIDTH;
+  fieldWidth = SCREEN_WIDTH;
+  fieldHeight = SCREEN_HEIGHT;
+  std::vector<sLineSegment> segments;
+  std::vector<sSpawn> spawnPoints;
+
+  std::string line;
+  for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+    line = line.substr(0, line.find('#'));
+    std::istringstream statement(line);
+    std::string keyword;
+    if (!(statement >> keyword))
+      continue;
+
+    bool parsed = false;
+    if (keyword == "field") {
+      parsed = static_cast<bool>(statement >> fieldWidth >> fieldHeight) && fieldWidth > 0 && fieldHeight > 0;
+    } else if (keyword == "lane") {
+      parsed = static_cast<bool>(statement >> laneSize) && laneSize > 0;
+    } else if (keyword == "segment") {
+      int x1, y1, x2, y2;
+      parsed = static_cast<bool>(statement >> x1 >> y1 >> x2 >> y2) && (x1 != x2 || y1 != y2);
+      if (parsed)
+        segments.emplace_back(sVec(x1, y1), sVec(x2, y2));
+    } else if (keyword == "spawn") {
+      int x, y;
+      std::string direction;
+      parsed = static_cast<bool>(statement >> x >> y >> direction);
+      static const std::map<std::string, eCarAlignment> alignments = {
+          {"east", CAR_MOVE_EAST}, {"west", CAR_MOVE_WEST}, {"north", CAR_MOVE_NORTH}, {"south", CAR_MOVE_SOUTH}};
+      auto alignment = alignments.find(direction);
+      parsed = parsed && alignment != alignments.end();
+      if (parsed)
+        spawnPoints.emplace_back(sVec(x, y), alignment->second);
+    }
+    std::string rest;
+    if (!parsed || statement >> rest)
+      throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": can't parse \"" + line + "\"");
+  }
+  if (segments.size() < 2 || spawnPoints.empty())
+    throw std::runtime_error("Scenario " + path + " needs at least two segments and a spawn");
+
+  sRoadData roadData(laneSize, segments, seed);
+  for (auto &spawn : spawnPoints) {
+    roadData.createSpawn(spawn.first, spawn.second, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  }
+  return roadData;
+}
+
+// The road chosen by a --scenario <file> or --grid <columns>x<rows> option,
+// or the default one when neither is given (null)
+sRoadData createRoadDataFromOptions(const char *scenarioPath, const char *gridSize, uint64_t seed, int &fieldWidth, int &fieldHeight) {
+  if (scenarioPath != nullptr)
+    return loadScenario(scenarioPath, seed, fieldWidth, fieldHeight);
+
+  if (gridSize != nullptr) {
+    int columns = 0, rows = 0;
+    char separator = 0;
+    if (std::sscanf(gridSize, "%d%c%d", &columns, &separator, &rows) != 3 || separator != 'x' || columns <= 0 || rows <= 0)
+      throw std::runtime_error(std::string("Grid size should look like 8x6, not ") + gridSize);
+    fieldWidth = (columns + 1) * GRID_BLOCK_SIZE;
+    fieldHeight = (rows + 1) * GRID_BLOCK_SIZE;
+    return createGridRoadData(columns, rows, fieldWidth, fieldHeight, seed);
+  }
+
+  fieldWidth = SCREEN_WIDTH;
+  fieldHeight = SCREEN_HEIGHT;
+  return createDefaultRoadData(seed);
+}
+
+void spawnCars(sRoadData &roadData, int count) {
+  for (int i = 0; i < count; ++i) {
+    auto *car = sCarFactory::createRandomCar(roadData.spawns, CAR_SIZE_BIG, CAR_SIZE_SMALL, roadData.random);
+    car->speed = 1;
+#ifdef USE_DEBUGGEE_CAR
+    if (i == 5)
+      car->debuggee = true;
+#endif
+    roadData.cars.push_back(car);
+  }
+}
+
+// Lines cars up behind their spawns one car length apart, so a big population
+// starts without overlaps instead of stacked on a handful of spawn points
+void queueCarsBehindSpawns(sRoadData &roadData) {
+  auto &cars = roadData.cars;
+  std::map<std::pair<int, int>, int> queued;
+  for (size_t i = 0; i < cars.size(); ++i) {
+    int &carsAhead = queued[std::make_pair(cars.x[i], cars.y[i])];
+    cars.moveBy(i, -cars.directions[i] * cars.sizes[i] * carsAhead++);
+  }
+}
+
+void destroyCars(sRoadData &roadData) {
+  for (auto *car : roadData.cars) {
+    delete car;
+  }
+  roadData.cars.clear();
+}
+
+#endif  // MYTONA_SCENARIO_HPP
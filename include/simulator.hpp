@@ -3,86 +3,194 @@
 
 #include <iostream>
 #include "structs.hpp"
+#include "spatial.hpp"
+#include "parallel.hpp"
+#include "profiler.hpp"
 
-void resolveCollisions(sRoadData &roadData) {
-  std::deque<sCar *> queue(roadData.cars.begin(), roadData.cars.end());
-  while (queue.size() > 0) {
-    sCar *&car = queue.back();
-    queue.pop_back();
+typedef std::pair<size_t, sVec> sCarMove;
 
-    for (auto *&otherCar : roadData.cars) {
-      if (car == otherCar)
-        continue;
-      if (car->rect.overlaps(otherCar->rect)) {
-        do {
-          car->rect.moveBy(-car->direction * car->rect.size());
-        } while (car->rect.overlaps(otherCar->rect));
-      }
+// Scratch buffers of the tick pipeline. Kept between ticks and refilled in
+// place, so once they have grown to the car count a tick doesn't allocate.
+struct sSimulationFrame {
+  sSweepAndPrune broadphase;
+  sCarGrid grid;
+  sLaneIndex lanes;
+  std::vector<sCrossingCarInfo> verboseCarsInfo;
+  std::vector<sCarMove> moveData;
+
+  // Runs the decision phase when set; not owned
+  sThreadPool *pool = nullptr;
+  // Receives stage timings in SIM_PROFILE builds when set; not owned
+  sProfiler *profiler = nullptr;
+};
+
+// Each car, last to first, is pushed back against every other car in order,
+// and each push only clears the car it is tested against. The sweep-and-prune
+// candidates reproduce that order: the next car to test is the lowest index
+// past the previous one that overlaps the current rect.
+void resolveCollisions(sRoadData &roadData, sSweepAndPrune &broadphase) {
+  broadphase.rebuild(roadData.cars);
+
+  auto &cars = roadData.cars;
+  for (size_t i = cars.size(); i-- > 0;) {
+    sRect carRect = cars.rect(i);
+    sVec pushBack = -cars.directions[i] * cars.sizes[i];
+    size_t nextOther = 0;
+    while (true) {
+      size_t other = cars.size();
+      broadphase.forEachCandidate(carRect, [&](size_t candidate) {
+        if (candidate != i && candidate >= nextOther && candidate < other && carRect.overlaps(cars.rect(candidate)))
+          other = candidate;
+      });
+      if (other == cars.size())
+        break;
+
+      sRect otherRect = cars.rect(other);
+      do {
+        carRect.moveBy(pushBack);
+      } while (carRect.overlaps(otherRect));
+      cars.moveTo(i, carRect.position());
+      broadphase.update(i, carRect);
+      nextOther = other + 1;
     }
   }
 }
 
-void respawnOutOfFieldCars(sRoadData &roadData, int scrWidth, int scrHeight) {
+void resolveCollisions(sRoadData &roadData) {
+  sSweepAndPrune broadphase;
+  resolveCollisions(roadData, broadphase);
+}
+
+// Puts the car back at a random spawn, drawing from the road's random stream
+void respawnCar(sRoadData &roadData, size_t i) {
+  sCarState car = roadData.cars.state(i);
+  sCarFactory::setRandomPositionAndAlign(&car, roadData.spawns, roadData.random);
+  car.wasInField = false;
+  roadData.cars.setState(i, car);
+}
+
+void respawnOutOfFieldCars(sRoadData &roadData, int scrWidth, int scrHeight, sSweepAndPrune &broadphase) {
   sRect screenRect(scrWidth, scrHeight);
   bool respawned = false;
 
-  for (auto *&car : roadData.cars) {
-    if (!car->wasInField) {
-      if (car->rect.contacts(screenRect)) {
-        car->wasInField = true;
+  auto &cars = roadData.cars;
+  for (size_t i = 0; i < cars.size(); ++i) {
+    if (!cars.hasFlag(i, sCarStore::WAS_IN_FIELD)) {
+      if (cars.rect(i).contacts(screenRect)) {
+        cars.setFlag(i, sCarStore::WAS_IN_FIELD, true);
       }
     } else {
-      if (!car->rect.contacts(screenRect)) {
-        sCarFactory::setRandomPositionAndAlign(car, roadData.spawns);
-        car->wasInField = false;
+      if (!cars.rect(i).contacts(screenRect)) {
+        respawnCar(roadData, i);
         respawned = true;
       }
     }
   }
 
   if (respawned)
-    resolveCollisions(roadData);
+    resolveCollisions(roadData, broadphase);
 }
 
-sCrossingCarInfo updateAndGetCrossingsDatas(sCar *car, sRoadData &roadData) {
-  for (auto &crossing : roadData.crossings) {
-    auto crossingInfo = crossing.getCrossingInfo(car);
-    crossing.updateCarData(car);
-    if (crossingInfo.isInCrossing) {
-      return crossingInfo;
-    }
+void respawnOutOfFieldCars(sRoadData &roadData, int scrWidth, int scrHeight) {
+  sSweepAndPrune broadphase;
+  respawnOutOfFieldCars(roadData, scrWidth, scrHeight, broadphase);
+}
+
+// Moves the car's registration to the crossing it now contacts, -1 for none
+void setCarCrossing(size_t car, int crossing, sRoadData &roadData) {
+  auto &cars = roadData.cars;
+  if (cars.crossings[car] != crossing) {
+    if (cars.crossings[car] >= 0)
+      roadData.crossings[cars.crossings[car]].removeCar(cars, car);
+    if (crossing >= 0)
+      roadData.crossings[crossing].addCar(cars, car);
+    cars.crossings[car] = crossing;
   }
-  return sCrossingCarInfo{car, nullptr, false, false, false};
 }
 
-std::vector<sCrossingCarInfo> getVerboseCarsInfo(sRoadData &roadData) {
-  std::vector<sCrossingCarInfo> crossingCarsInfos;
+sCrossingCarInfo getCrossingCarInfo(size_t car, const sRoadData &roadData) {
+  int crossing = roadData.cars.crossings[car];
+  if (crossing < 0)
+    return sCrossingCarInfo{car, nullptr, false, false, false};
+  return roadData.crossings[crossing].getCrossingInfo(roadData.cars, car);
+}
+
+// A car is registered in the first crossing it contacts, looked up through the
+// crossing index, and leaves the one it was registered in before
+sCrossingCarInfo updateAndGetCrossingsDatas(size_t car, sRoadData &roadData) {
+  auto &cars = roadData.cars;
+  setCarCrossing(car, roadData.crossingIndex.findCrossing(cars.rect(car), cars.directions[car], roadData.crossings), roadData);
+  return getCrossingCarInfo(car, roadData);
+}
+
+void getVerboseCarsInfo(sRoadData &roadData, std::vector<sCrossingCarInfo> &crossingCarsInfos) {
+  crossingCarsInfos.clear();
   crossingCarsInfos.reserve(roadData.cars.size());
-  for (auto *&car : roadData.cars) {
+  for (size_t car = 0; car < roadData.cars.size(); ++car) {
     crossingCarsInfos.emplace_back(updateAndGetCrossingsDatas(car, roadData));
   }
+}
+
+std::vector<sCrossingCarInfo> getVerboseCarsInfo(sRoadData &roadData) {
+  std::vector<sCrossingCarInfo> crossingCarsInfos;
+  getVerboseCarsInfo(roadData, crossingCarsInfos);
   return crossingCarsInfos;
 }
 
-std::pair<sCar *, sVec> getNextCarPositionPair(const sCrossingCarInfo &carCrossingInfo, const std::vector<sCrossingCarInfo> &crossingCarsInfos, sRoadData &roadData) {
-#define DEBUG_CAR if (carCrossingInfo.car->debuggee)
-  sRect forwardRect = carCrossingInfo.car->forwardRect();
+// Without a grid every other car is scanned, which is kept as the reference behaviour
+sCarMove getNextCarPositionPair(const sCrossingCarInfo &carCrossingInfo, const std::vector<sCrossingCarInfo> &crossingCarsInfos, sRoadData &roadData,
+                                const sCarGrid *grid = nullptr, const sLaneIndex *lanes = nullptr) {
+  const sCarStore &cars = roadData.cars;
+  const size_t car = carCrossingInfo.car;
+#define DEBUG_CAR if (cars.hasFlag(car, sCarStore::DEBUGGEE))
+  sRect forwardRect = cars.forwardRect(car);
+  sRect futureRect = cars.futureRect(car);
+  const sVec &direction = cars.directions[car];
   bool shouldMove = true;
   bool frontCollisionPrevented = false;
   bool dangerousCollision = false;
 
   bool debuggeePrinted = false;
 
-  // check for car in front of that one
-  for (auto &otherCarInfo : crossingCarsInfos) {
-    const auto *otherCar = otherCarInfo.car;
-    if (carCrossingInfo.car == otherCar)
-      continue;
+  auto forEachNearbyCar = [&](const sRect &area, auto fn) {
+    if (grid == nullptr) {
+      for (auto &otherCarInfo : crossingCarsInfos) {
+        fn(otherCarInfo);
+      }
+    } else {
+      grid->forEachCandidate(area, [&](size_t i) { fn(crossingCarsInfos[i]); });
+    }
+  };
+
+  // only cars going the same way can block the one in front, the lane index has them as neighbours
+  auto forEachCarAhead = [&](auto fn) {
+    if (lanes == nullptr) {
+      forEachNearbyCar(forwardRect, fn);
+    } else {
+      lanes->forEachCandidate(car, direction, forwardRect, [&](size_t i) { fn(crossingCarsInfos[i]); });
+    }
+  };
 
-    if (!dangerousCollision) {
-      dangerousCollision = carCrossingInfo.car->futureRect().overlaps(otherCar->rect);
+  auto findCrossingCar = [&](auto predicate) -> const sCrossingCarInfo * {
+    if (grid == nullptr) {
+      auto it = std::find_if(crossingCarsInfos.begin(), crossingCarsInfos.end(), predicate);
+      return it != crossingCarsInfos.end() ? &*it : nullptr;
     }
-    if (forwardRect.overlaps(otherCar->rect) && otherCarInfo.car->direction == carCrossingInfo.car->direction) {
+    const sCrossingCarInfo *found = nullptr;
+    grid->forEachInCrossing(carCrossingInfo.crossing, [&](size_t i) {
+      if (found == nullptr && predicate(crossingCarsInfos[i]))
+        found = &crossingCarsInfos[i];
+    });
+    return found;
+  };
+
+  // check for car in front of that one
+  forEachCarAhead([&](const sCrossingCarInfo &otherCarInfo) {
+    size_t otherCar = otherCarInfo.car;
+    if (car == otherCar || frontCollisionPrevented)
+      return;
+
+    if (forwardRect.overlaps(cars.rect(otherCar)) && cars.directions[otherCar] == direction) {
       // don't collide into the back
       shouldMove = false;
       frontCollisionPrevented = true;
@@ -91,41 +199,35 @@ std::pair<sCar *, sVec> getNextCarPositionPair(const sCrossingCarInfo &carCrossi
         debuggeePrinted = true;
       }
     }
-  }
+  });
 
   DEBUG_CAR {
-    if (!carCrossingInfo.car->checkSides) {
+    if (!cars.hasFlag(car, sCarStore::CHECK_SIDES)) {
       std::cout << "Move: Force deadlocked crossing" << std::endl;
       debuggeePrinted = true;
     }
   }
-  if (carCrossingInfo.car->checkSides && !frontCollisionPrevented) {
+  if (cars.hasFlag(car, sCarStore::CHECK_SIDES) && !frontCollisionPrevented) {
     if (carCrossingInfo.isInCrossing && carCrossingInfo.isTouched) {
       // if inside the crossing check for a car coming from the right
-      sVec leftPerpendicular = carCrossingInfo.car->direction.leftPerpendicular();
-      auto carFromRightIt = std::find_if(                                                              //
-      /**/ crossingCarsInfos.begin(),                                                                  //
-      /**/ crossingCarsInfos.end(),                                                                    //
-      [&](const sCrossingCarInfo &info) -> bool {                                                      //
-        return info.crossing == carCrossingInfo.crossing && info.car->direction == leftPerpendicular;  //
+      sVec leftPerpendicular = direction.leftPerpendicular();
+      auto *carFromRight = findCrossingCar([&](const sCrossingCarInfo &info) -> bool {                //
+        return info.crossing == carCrossingInfo.crossing && cars.directions[info.car] == leftPerpendicular;  //
       });
 
-      if (carFromRightIt != crossingCarsInfos.end()) {
+      if (carFromRight != nullptr) {
         shouldMove = false;
         DEBUG_CAR {
-          std::cout << "Yield: Right car. other dir: x=" << carFromRightIt->car->direction.x << ", y=" << carFromRightIt->car->direction.y << std::endl;
+          std::cout << "Yield: Right car. other dir: x=" << cars.directions[carFromRight->car].x << ", y=" << cars.directions[carFromRight->car].y << std::endl;
           debuggeePrinted = true;
         }
       } else {
         // pass left car that is already started to cross intersection
-        sVec rightPerpendicular = carCrossingInfo.car->direction.rightPerpendicular();
-        auto carFromLeftIt = std::find_if(                                                                                                        //
-        /**/ crossingCarsInfos.begin(),                                                                                                           //
-        /**/ crossingCarsInfos.end(),                                                                                                             //
-        [&](const sCrossingCarInfo &info) -> bool {                                                                                               //
-          return !info.isTouched && !info.justWentOut && info.crossing == carCrossingInfo.crossing && info.car->direction == rightPerpendicular;  //
+        sVec rightPerpendicular = direction.rightPerpendicular();
+        auto *carFromLeft = findCrossingCar([&](const sCrossingCarInfo &info) -> bool {                                                         //
+          return !info.isTouched && !info.justWentOut && info.crossing == carCrossingInfo.crossing && cars.directions[info.car] == rightPerpendicular;  //
         });
-        if (carFromLeftIt != crossingCarsInfos.end()) {
+        if (carFromLeft != nullptr) {
           // car in the middle of intersection from left found
           shouldMove = false;
           DEBUG_CAR {
@@ -142,6 +244,14 @@ std::pair<sCar *, sVec> getNextCarPositionPair(const sCrossingCarInfo &carCrossi
     }
   }
 
+  // only matters for a car that would otherwise move, most queued cars already stopped behind their leader
+  if (shouldMove) {
+    forEachNearbyCar(futureRect, [&](const sCrossingCarInfo &otherCarInfo) {
+      if (!dangerousCollision && car != otherCarInfo.car) {
+        dangerousCollision = futureRect.overlaps(cars.rect(otherCarInfo.car));
+      }
+    });
+  }
   if (shouldMove && dangerousCollision) {
     shouldMove = false;
     DEBUG_CAR {
@@ -157,63 +267,115 @@ std::pair<sCar *, sVec> getNextCarPositionPair(const sCrossingCarInfo &carCrossi
     }
   }
 
-  return shouldMove                                                                    //
-         ? std::make_pair(carCrossingInfo.car, carCrossingInfo.car->futurePosition())  //
-         : std::make_pair(carCrossingInfo.car, carCrossingInfo.car->rect.position());  //
+  return shouldMove                                      //
+         ? std::make_pair(car, cars.futurePosition(car))  //
+         : std::make_pair(car, cars.position(car));       //
 }
 
-std::vector<std::pair<sCar *, sVec>> getNextCarsPositionPairs(sRoadData &roadData, std::vector<sCrossingCarInfo> &verboseCarsInfo) {
-  std::vector<std::pair<sCar *, sVec>> movingsData;
-  movingsData.reserve(roadData.cars.size());
-  for (auto &carInfo : verboseCarsInfo) {
-    movingsData.emplace_back(getNextCarPositionPair(carInfo, verboseCarsInfo, roadData));
+// Decisions only read the world, so with a pool each worker fills its own
+// cache-line aligned range of the output and the result is the serial one
+void getNextCarsPositionPairs(sRoadData &roadData, const std::vector<sCrossingCarInfo> &verboseCarsInfo, sCarGrid &grid, sLaneIndex &lanes,
+                              std::vector<sCarMove> &movingsData, sThreadPool *pool = nullptr) {
+  grid.rebuild(roadData.cars, verboseCarsInfo, roadData.crossings);
+  lanes.refresh(roadData.cars);
+
+  movingsData.resize(verboseCarsInfo.size());
+  auto decide = [&](size_t begin, size_t end) {
+    for (size_t i = begin; i < end; ++i) {
+      movingsData[i] = getNextCarPositionPair(verboseCarsInfo[i], verboseCarsInfo, roadData, &grid, &lanes);
+    }
+  };
+  if (pool == nullptr) {
+    decide(0, verboseCarsInfo.size());
+  } else {
+    pool->parallelFor(verboseCarsInfo.size(), cacheAlignedChunk(verboseCarsInfo.size(), sizeof(sCarMove), pool->concurrency()), decide);
   }
+}
+
+std::vector<sCarMove> getNextCarsPositionPairs(sRoadData &roadData, const std::vector<sCrossingCarInfo> &verboseCarsInfo) {
+  sCarGrid grid;
+  sLaneIndex lanes;
+  std::vector<sCarMove> movingsData;
+  getNextCarsPositionPairs(roadData, verboseCarsInfo, grid, lanes, movingsData);
   return movingsData;
 }
 
-void resolveDeadlocks(sRoadData &roadData) {
-  for (auto &crossing : roadData.crossings) {
-    if (!crossing.isDeadlocked()) {
-      continue;
-    }
+// Lets one car of a deadlocked crossing go first, ignoring the cars at its sides
+void resolveDeadlock(sRoadData &roadData, sCrossing &crossing) {
+  const sCarStore &cars = roadData.cars;
+  if (!crossing.isDeadlocked(cars))
+    return;
 
-    std::sort(crossing.cars.begin(), crossing.cars.end(), [](const sCar *c1, const sCar *c2) -> bool {  //
-      return c1->rect.x() < c2->rect.x();                                                               //
-    });
+  crossing.cars.sort(roadData.cars, [&](size_t c1, size_t c2) -> bool {  //
+    return cars.x[c1] < cars.x[c2];                                     //
+  });
 
-    sCar *carToMoveFirst = nullptr;
-    for (auto *&car : crossing.cars) {
-      sRect bigForwardCast = car->forwardRect();
-      if (car->direction.y == 0) {
-        bigForwardCast.setWidth(crossing.rect.width());
-      }
-      if (car->direction.x == 0) {
-        bigForwardCast.setHeight(crossing.rect.width());
-      }
+  const size_t noCar = cars.size();
+  size_t carToMoveFirst = noCar;
+  for (auto car : crossing.cars) {
+    sRect bigForwardCast = cars.forwardRect(car);
+    if (cars.directions[car].y == 0) {
+      bigForwardCast.setWidth(crossing.rect.width());
+    }
+    if (cars.directions[car].x == 0) {
+      bigForwardCast.setHeight(crossing.rect.width());
+    }
 
-      bool carFound = true;
-      for (auto *&otherCar : crossing.cars) {
-        if (car == otherCar)
-          continue;
-        if (bigForwardCast.overlaps(otherCar->rect)) {
-          carFound = false;
-          break;
-        }
-      }
-      if (carFound) {
-        carToMoveFirst = car;
+    bool carFound = true;
+    for (auto otherCar : crossing.cars) {
+      if (car == otherCar)
+        continue;
+      if (bigForwardCast.overlaps(cars.rect(otherCar))) {
+        carFound = false;
         break;
       }
     }
-    if (carToMoveFirst != nullptr)
-      carToMoveFirst->checkSides = false;
+    if (carFound) {
+      carToMoveFirst = car;
+      break;
+    }
   }
+  if (carToMoveFirst != noCar)
+    roadData.cars.setFlag(carToMoveFirst, sCarStore::CHECK_SIDES, false);
 }
 
-void handleMovings(std::vector<std::pair<sCar *, sVec>> &moveData) {
+void resolveDeadlocks(sRoadData &roadData) {
+  for (auto &crossing : roadData.crossings) {
+    resolveDeadlock(roadData, crossing);
+  }
+}
+
+void handleMovings(sRoadData &roadData, const std::vector<sCarMove> &moveData) {
   for (auto &pair : moveData) {
-    auto *&car = pair.first;
-    car->rect.moveTo(pair.second);
+    roadData.cars.moveTo(pair.first, pair.second);
+  }
+}
+
+void simulateTick(sRoadData &roadData, sSimulationFrame &frame, int scrWidth, int scrHeight) {
+  PROFILE_SCOPE(frame.profiler, PROFILE_SIMULATE_TICK);
+  {
+    PROFILE_SCOPE(frame.profiler, PROFILE_RESOLVE_COLLISIONS);
+    resolveCollisions(roadData, frame.broadphase);
+  }
+  {
+    PROFILE_SCOPE(frame.profiler, PROFILE_RESPAWN_OUT_OF_FIELD_CARS);
+    respawnOutOfFieldCars(roadData, scrWidth, scrHeight, frame.broadphase);
+  }
+  {
+    PROFILE_SCOPE(frame.profiler, PROFILE_GET_VERBOSE_CARS_INFO);
+    getVerboseCarsInfo(roadData, frame.verboseCarsInfo);
+  }
+  {
+    PROFILE_SCOPE(frame.profiler, PROFILE_GET_NEXT_CARS_POSITION_PAIRS);
+    getNextCarsPositionPairs(roadData, frame.verboseCarsInfo, frame.grid, frame.lanes, frame.moveData, frame.pool);
+  }
+  {
+    PROFILE_SCOPE(frame.profiler, PROFILE_RESOLVE_DEADLOCKS);
+    resolveDeadlocks(roadData);
+  }
+  {
+    PROFILE_SCOPE(frame.profiler, PROFILE_HANDLE_MOVINGS);
+    handleMovings(roadData, frame.moveData);
   }
 }
 
@@ -0,0 +1,392 @@
+#ifndef MYTONA_SNAPSHOT_HPP
+#define MYTONA_SNAPSHOT_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <type_traits>
+#include <tuple>
+#include <algorithm>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#include "structs.hpp"
+
+// Whole road data as a flat file: a fixed header followed by one section per
+// array, each a plain copy of the in-memory elements aligned to a cache line.
+// Restoring maps the file and bulk-copies every section into place, so the
+// crossings aren't searched again and only the sCar handles are allocated.
+// Crossings are saved as their rects; which cars each holds follows from the
+// cars' crossings and slots and is registered again in the saved order.
+// The layout is the host's, and the header records each element size so a
+// build with different struct layouts refuses the file instead of misreading it.
+
+static constexpr uint32_t SNAPSHOT_MAGIC = 0x50414e53;  // "SNAP"
+static constexpr uint32_t SNAPSHOT_VERSION = 3;
+static constexpr uint32_t SNAPSHOT_BYTE_ORDER = 0x01020304;
+static constexpr uint64_t SNAPSHOT_ALIGNMENT = 64;
+
+enum eSnapshotSection {
+  SNAPSHOT_SEGMENTS,
+  SNAPSHOT_SPAWNS,
+  SNAPSHOT_CROSSINGS,
+  SNAPSHOT_CROSSING_SEGMENTS,
+  SNAPSHOT_CAR_X,
+  SNAPSHOT_CAR_Y,
+  SNAPSHOT_CAR_SIZES,
+  SNAPSHOT_CAR_DIRECTIONS,
+  SNAPSHOT_CAR_SPEEDS,
+  SNAPSHOT_CAR_FLAGS,
+  SNAPSHOT_CAR_KINDS,
+  SNAPSHOT_CAR_CROSSINGS,
+  SNAPSHOT_CAR_CROSSING_SLOTS,
+  SNAPSHOT_CAR_FUEL,
+  SNAPSHOT_CAR_CHARGE,
+  SNAPSHOT_CAR_RANDOM,
+  SNAPSHOT_SECTION_COUNT
+};
+
+struct sSnapshotSection {
+  uint64_t offset, count, elementSize;
+};
+
+struct sSnapshotHeader {
+  uint32_t magic, version, byteOrder;
+  int32_t laneSize;
+  int32_t fieldWidth, fieldHeight;
+  sRandom random{0};
+  sSnapshotSection sections[SNAPSHOT_SECTION_COUNT];
+};
+
+struct sSnapshotSpawn {
+  sVec position;
+  int32_t alignment;
+};
+
+// Tank contents of one car; a hybrid uses all of it, the others what they have
+struct sCarTanks {
+  int fuel = 0, charge = 0;
+  sRandom random{0};
+};
+
+// The kind picks the concrete type; sCar is a virtual base, so reaching it
+// still takes a cast, but only the one that matches
+sCarTanks getCarTanks(const sCarStore &cars, size_t i) {
+  sCarTanks tanks;
+  switch (cars.kinds[i]) {
+    case CAR_KIND_GAS:
+      tanks.fuel = dynamic_cast<const sGasCar &>(*cars[i]).fuel;
+      break;
+    case CAR_KIND_ELECTRO:
+      tanks.charge = dynamic_cast<const sElectroCar &>(*cars[i]).charge;
+      break;
+    case CAR_KIND_HYBRID: {
+      const auto &hybridCar = dynamic_cast<const sHybridCar &>(*cars[i]);
+      tanks.fuel = hybridCar.fuel;
+      tanks.charge = hybridCar.charge;
+      tanks.random = hybridCar.random;
+      break;
+    }
+    default:
+      throw std::runtime_error("Unknown car kind");
+  }
+  return tanks;
+}
+
+sCar *createCarWithTanks(eCarKind kind, const sCarTanks &tanks) {
+  switch (kind) {
+    case CAR_KIND_GAS: {
+      auto *car = new sGasCar();
+      car->fuel = tanks.fuel;
+      return car;
+    }
+    case CAR_KIND_ELECTRO: {
+      auto *car = new sElectroCar();
+      car->charge = tanks.charge;
+      return car;
+    }
+    case CAR_KIND_HYBRID: {
+      auto *car = new sHybridCar();
+      car->fuel = tanks.fuel;
+      car->charge = tanks.charge;
+      car->random = tanks.random;
+      return car;
+    }
+    default:
+      throw std::runtime_error("Unknown car kind in snapshot");
+  }
+}
+
+struct sSnapshotWriter {
+  std::FILE *file;
+  sSnapshotHeader header{};
+  uint64_t offset = 0;
+
+  template <typename T>
+  void writeSection(eSnapshotSection section, const std::vector<T> &elements) {
+    static_assert(std::is_trivially_copyable<T>::value, "Snapshot sections are plain copies");
+    static const char padding[SNAPSHOT_ALIGNMENT] = {};
+    uint64_t aligned = (offset + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+    write(padding, aligned - offset);
+    header.sections[section] = sSnapshotSection{aligned, elements.size(), sizeof(T)};
+    write(elements.data(), elements.size() * sizeof(T));
+  }
+
+  void write(const void *data, uint64_t size) {
+    if (size != 0 && std::fwrite(data, 1, size, file) != size)
+      throw std::runtime_error("Can't write snapshot");
+    offset += size;
+  }
+};
+
+void saveSnapshot(const sRoadData &roadData, int fieldWidth, int fieldHeight, const std::string &path) {
+  std::FILE *file = std::fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    throw std::runtime_error("Can't open " + path + " for writing");
+
+  sSnapshotWriter writer{file};
+  try {
+    sSnapshotHeader &header = writer.header;
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.byteOrder = SNAPSHOT_BYTE_ORDER;
+    header.laneSize = roadData.laneSize;
+    header.fieldWidth = fieldWidth;
+    header.fieldHeight = fieldHeight;
+    header.random = roadData.random;
+    writer.write(&header, sizeof(header));
+
+    std::vector<sSnapshotSpawn> spawns;
+    for (auto &spawn : roadData.spawns) {
+      spawns.push_back(sSnapshotSpawn{spawn.first, static_cast<int32_t>(spawn.second)});
+    }
+    std::vector<uint64_t> crossingSegments;
+    for (auto &pair : roadData.crossingSegments) {
+      crossingSegments.push_back(pair.first);
+      crossingSegments.push_back(pair.second);
+    }
+    const sCarStore &cars = roadData.cars;
+    std::vector<int> fuel(cars.size()), charge(cars.size());
+    std::vector<sRandom> carRandom(cars.size());
+    for (size_t i = 0; i < cars.size(); ++i) {
+      sCarTanks tanks = getCarTanks(cars, i);
+      fuel[i] = tanks.fuel;
+      charge[i] = tanks.charge;
+      carRandom[i] = tanks.random;
+    }
+
+    writer.writeSection(SNAPSHOT_SEGMENTS, roadData.roadSegments);
+    writer.writeSection(SNAPSHOT_SPAWNS, spawns);
+    std::vector<sRect> crossingRects;
+    for (auto &crossing : roadData.crossings) {
+      crossingRects.push_back(crossing.rect);
+    }
+    writer.writeSection(SNAPSHOT_CROSSINGS, crossingRects);
+    writer.writeSection(SNAPSHOT_CROSSING_SEGMENTS, crossingSegments);
+    writer.writeSection(SNAPSHOT_CAR_X, cars.x);
+    writer.writeSection(SNAPSHOT_CAR_Y, cars.y);
+    writer.writeSection(SNAPSHOT_CAR_SIZES, cars.sizes);
+    writer.writeSection(SNAPSHOT_CAR_DIRECTIONS, cars.directions);
+    writer.writeSection(SNAPSHOT_CAR_SPEEDS, cars.speeds);
+    writer.writeSection(SNAPSHOT_CAR_FLAGS, cars.flags);
+    writer.writeSection(SNAPSHOT_CAR_KINDS, cars.kinds);
+    writer.writeSection(SNAPSHOT_CAR_CROSSINGS, cars.crossings);
+    writer.writeSection(SNAPSHOT_CAR_CROSSING_SLOTS, cars.crossingSlots);
+    writer.writeSection(SNAPSHOT_CAR_FUEL, fuel);
+    writer.writeSection(SNAPSHOT_CAR_CHARGE, charge);
+    writer.writeSection(SNAPSHOT_CAR_RANDOM, carRandom);
+
+    // the section table is only known now
+    if (std::fseek(file, 0, SEEK_SET) != 0 || std::fwrite(&header, sizeof(header), 1, file) != 1)
+      throw std::runtime_error("Can't write snapshot");
+  } catch (...) {
+    std::fclose(file);
+    throw;
+  }
+  if (std::fclose(file) != 0)
+    throw std::runtime_error("Can't write snapshot");
+}
+
+// Read-only view of a whole file, mapped where the platform allows
+struct sMappedFile {
+  const unsigned char *data = nullptr;
+  size_t size = 0;
+
+  explicit sMappedFile(const std::string &path) {
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("Can't open " + path);
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Can't read " + path);
+    }
+    size = static_cast<size_t>(info.st_size);
+    if (size != 0) {
+      void *mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapping == MAP_FAILED)
+        throw std::runtime_error("Can't map " + path);
+      data = static_cast<const unsigned char *>(mapping);
+    } else {
+      ::close(fd);
+    }
+#else
+    std::FILE *file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      throw std::runtime_error("Can't open " + path);
+    std::fseek(file, 0, SEEK_END);
+    buffer.resize(std::ftell(file));
+    std::fseek(file, 0, SEEK_SET);
+    bool complete = std::fread(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    std::fclose(file);
+    if (!complete)
+      throw std::runtime_error("Can't read " + path);
+    data = buffer.data();
+    size = buffer.size();
+#endif
+  }
+
+  ~sMappedFile() {
+#ifndef _WIN32
+    if (data != nullptr)
+      ::munmap(const_cast<unsigned char *>(data), size);
+#endif
+  }
+
+  sMappedFile(const sMappedFile &) = delete;
+  sMappedFile &operator=(const sMappedFile &) = delete;
+
+#ifdef _WIN32
+ private:
+  std::vector<unsigned char> buffer;
+#endif
+};
+
+template <typename T>
+void readSnapshotSection(const sMappedFile &file, const sSnapshotHeader &header, eSnapshotSection section, std::vector<T> &elements) {
+  static_assert(std::is_trivially_copyable<T>::value, "Snapshot sections are plain copies");
+  const sSnapshotSection &entry = header.sections[section];
+  if (entry.elementSize != sizeof(T))
+    throw std::runtime_error("Snapshot was written with a different struct layout");
+  if (entry.offset > file.size || entry.count > (file.size - entry.offset) / sizeof(T))
+    throw std::runtime_error("Truncated snapshot");
+  // sections are aligned for T, so the mapped bytes are read as elements in place
+  const T *first = reinterpret_cast<const T *>(file.data + entry.offset);
+  elements.assign(first, first + entry.count);
+}
+
+// Registers every car in the crossing it was saved in, in the saved slot
+// order; the slots are numbered afresh, which keeps the order that matters
+void registerSnapshotCrossings(sCarStore &cars, std::vector<sCrossing> &crossings) {
+  std::vector<std::tuple<int, int, size_t>> members;
+  for (size_t i = 0; i < cars.x.size(); ++i) {
+    int crossing = cars.crossings[i], slot = cars.crossingSlots[i];
+    if ((crossing < 0) != (slot < 0) || crossing >= static_cast<int>(crossings.size()))
+      throw std::runtime_error("Snapshot car crossings are out of range");
+    if (crossing >= 0)
+      members.emplace_back(crossing, slot, i);
+    cars.crossingSlots[i] = -1;
+  }
+  std::sort(members.begin(), members.end());
+  for (size_t m = 0; m < members.size(); ++m) {
+    if (m > 0 && std::get<0>(members[m]) == std::get<0>(members[m - 1]) && std::get<1>(members[m]) == std::get<1>(members[m - 1]))
+      throw std::runtime_error("Snapshot cars share a crossing slot");
+    crossings[std::get<0>(members[m])].addCar(cars, std::get<2>(members[m]));
+  }
+}
+
+// Road data as it was saved, cars included, and the field it ran on; the cars are the caller's to delete
+sRoadData loadSnapshot(const std::string &path, int &fieldWidth, int &fieldHeight) {
+  sMappedFile file(path);
+  sSnapshotHeader header;
+  if (file.size < sizeof(header))
+    throw std::runtime_error("Not a snapshot: " + path);
+  std::memcpy(&header, file.data, sizeof(header));
+  if (header.magic != SNAPSHOT_MAGIC || header.byteOrder != SNAPSHOT_BYTE_ORDER)
+    throw std::runtime_error("Not a snapshot: " + path);
+  if (header.version != SNAPSHOT_VERSION)
+    throw std::runtime_error("Unsupported snapshot version: " + path);
+  if (header.fieldWidth <= 0 || header.fieldHeight <= 0)
+    throw std::runtime_error("Snapshot field is empty: " + path);
+  fieldWidth = header.fieldWidth;
+  fieldHeight = header.fieldHeight;
+
+  std::vector<sLineSegment> segments;
+  std::vector<sSnapshotSpawn> spawns;
+  std::vector<sRect> crossingRects;
+  std::vector<uint64_t> crossingSegmentIndices;
+  readSnapshotSection(file, header, SNAPSHOT_SEGMENTS, segments);
+  readSnapshotSection(file, header, SNAPSHOT_SPAWNS, spawns);
+  readSnapshotSection(file, header, SNAPSHOT_CROSSINGS, crossingRects);
+  readSnapshotSection(file, header, SNAPSHOT_CROSSING_SEGMENTS, crossingSegmentIndices);
+  if (crossingSegmentIndices.size() != crossingRects.size() * 2)
+    throw std::runtime_error("Snapshot crossings don't match their segments");
+  std::vector<std::pair<size_t, size_t>> crossingSegments;
+  std::vector<sCrossing> crossings;
+  for (size_t c = 0; c < crossingRects.size(); ++c) {
+    crossings.emplace_back(crossingRects[c]);
+    if (crossingSegmentIndices[2 * c] >= segments.size() || crossingSegmentIndices[2 * c + 1] >= segments.size())
+      throw std::runtime_error("Snapshot crossings don't match their segments");
+    crossingSegments.emplace_back(crossingSegmentIndices[2 * c], crossingSegmentIndices[2 * c + 1]);
+  }
+
+  sRoadData roadData(header.laneSize, std::move(segments), std::move(crossings), std::move(crossingSegments));
+  roadData.random = header.random;
+  for (auto &spawn : spawns) {
+    roadData.spawns.emplace_back(spawn.position, static_cast<eCarAlignment>(spawn.alignment));
+  }
+
+  sCarStore &cars = roadData.cars;
+  readSnapshotSection(file, header, SNAPSHOT_CAR_X, cars.x);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_Y, cars.y);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_SIZES, cars.sizes);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_DIRECTIONS, cars.directions);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_SPEEDS, cars.speeds);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_FLAGS, cars.flags);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_KINDS, cars.kinds);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_CROSSINGS, cars.crossings);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_CROSSING_SLOTS, cars.crossingSlots);
+
+  std::vector<int> fuel, charge;
+  std::vector<sRandom> carRandom;
+  readSnapshotSection(file, header, SNAPSHOT_CAR_FUEL, fuel);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_CHARGE, charge);
+  readSnapshotSection(file, header, SNAPSHOT_CAR_RANDOM, carRandom);
+
+  size_t carsCount = cars.x.size();
+  const size_t counts[] = {cars.y.size(),     cars.sizes.size(),         cars.directions.size(), cars.speeds.size(), cars.flags.size(), cars.kinds.size(),
+                           cars.crossings.size(), cars.crossingSlots.size(), fuel.size(),            charge.size(),      carRandom.size()};
+  for (size_t count : counts) {
+    if (count != carsCount)
+      throw std::runtime_error("Snapshot car arrays differ in length");
+  }
+  registerSnapshotCrossings(cars, roadData.crossings);
+
+  cars.handles.reserve(carsCount);
+  try {
+    for (size_t i = 0; i < carsCount; ++i) {
+      sCarTanks tanks;
+      tanks.fuel = fuel[i];
+      tanks.charge = charge[i];
+      tanks.random = carRandom[i];
+      cars.handles.push_back(createCarWithTanks(cars.kinds[i], tanks));
+    }
+  } catch (...) {
+    for (auto *car : cars.handles) {
+      delete car;
+    }
+    throw;
+  }
+  cars.syncToCars();
+  return roadData;
+}
+
+#endif  // MYTONA_SNAPSHOT_HPP
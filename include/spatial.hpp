@@ -0,0 +1,425 @@
+#ifndef MYTONA_SPATIAL_HPP
+#define MYTONA_SPATIAL_HPP
+
+#include <vector>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
+#include "structs.hpp"
+
+// Uniform grid over car rects, hashed into a fixed number of buckets so the
+// world doesn't need bounds. Indices are car store indices, which are also
+// the positions in the sCrossingCarInfo vector the grid was built from. A
+// bucket may hold cars of several cells (hash collisions) and a car spanning
+// several cells appears in all of them, so queries return candidates only:
+// callers still do the exact rect test.
+struct sCarGrid {
+  int cellSize = 1;
+  size_t bucketMask = 0;
+  std::vector<size_t> bucketStart;
+  std::vector<size_t> entries;
+
+  // Cars grouped by the crossing they were reported in, in info order
+  const sCrossing *crossingsBase = nullptr;
+  std::vector<size_t> crossingStart;
+  std::vector<size_t> crossingEntries;
+
+  std::vector<size_t> cursor;
+
+  void rebuild(const sCarStore &cars, const std::vector<sCrossingCarInfo> &infos, const std::vector<sCrossing> &crossings) {
+    rebuildFrom(cars, cars.size(), [](size_t k) { return k; }, &infos, crossings);
+  }
+
+  // Over the given cars only, in ascending index order so crossings list them
+  // in info order too. Without infos no car is grouped by crossing.
+  void rebuild(const sCarStore &cars, const std::vector<size_t> &subset, const std::vector<sCrossingCarInfo> *infos, const std::vector<sCrossing> &crossings) {
+    rebuildFrom(cars, subset.size(), [&](size_t k) { return subset[k]; }, infos, crossings);
+  }
+
+  // Calls fn(index) for every car whose cells intersect the rect, possibly more than once
+  template <typename F>
+  void forEachCandidate(const sRect &rect, F fn) const {
+    forEachBucket(rect, [&](size_t bucket) {
+      for (size_t e = bucketStart[bucket]; e < bucketStart[bucket + 1]; ++e) {
+        fn(entries[e]);
+      }
+    });
+  }
+
+  // Calls fn(index) for every car reported in the crossing, in info order
+  template <typename F>
+  void forEachInCrossing(const sCrossing *crossing, F fn) const {
+    size_t c = crossingIndex(crossing);
+    for (size_t e = crossingStart[c]; e < crossingStart[c + 1]; ++e) {
+      fn(crossingEntries[e]);
+    }
+  }
+
+ private:
+  template <typename CarAt>
+  void rebuildFrom(const sCarStore &cars, size_t count, CarAt carAt, const std::vector<sCrossingCarInfo> *infos, const std::vector<sCrossing> &crossings) {
+    cellSize = 1;
+    for (size_t k = 0; k < count; ++k) {
+      const sVec &size = cars.sizes[carAt(k)];
+      cellSize = std::max(cellSize, std::max(size.x, size.y));
+    }
+
+    size_t bucketCount = 64;
+    while (bucketCount < count * 2) {
+      bucketCount <<= 1;
+    }
+    bucketMask = bucketCount - 1;
+
+    bucketStart.assign(bucketCount + 1, 0);
+    for (size_t k = 0; k < count; ++k) {
+      forEachBucket(cars.rect(carAt(k)), [&](size_t bucket) { ++bucketStart[bucket + 1]; });
+    }
+    for (size_t b = 0; b < bucketCount; ++b) {
+      bucketStart[b + 1] += bucketStart[b];
+    }
+    // a car spans at most 2x2 cells, reserving for that keeps rebuilds allocation free
+    entries.reserve(count * 4);
+    entries.resize(bucketStart[bucketCount]);
+    cursor.assign(bucketStart.begin(), bucketStart.end() - 1);
+    for (size_t k = 0; k < count; ++k) {
+      size_t i = carAt(k);
+      forEachBucket(cars.rect(i), [&](size_t bucket) { entries[cursor[bucket]++] = i; });
+    }
+
+    crossingsBase = crossings.data();
+    crossingStart.assign(crossings.size() + 1, 0);
+    crossingEntries.reserve(count);
+    crossingEntries.clear();
+    if (infos == nullptr)
+      return;
+    for (size_t k = 0; k < count; ++k) {
+      const sCrossingCarInfo &info = (*infos)[carAt(k)];
+      if (info.crossing != nullptr)
+        ++crossingStart[crossingIndex(info.crossing) + 1];
+    }
+    for (size_t c = 0; c < crossings.size(); ++c) {
+      crossingStart[c + 1] += crossingStart[c];
+    }
+    crossingEntries.resize(crossingStart[crossings.size()]);
+    cursor.assign(crossingStart.begin(), crossingStart.end() - 1);
+    for (size_t k = 0; k < count; ++k) {
+      size_t i = carAt(k);
+      const sCrossingCarInfo &info = (*infos)[i];
+      if (info.crossing != nullptr)
+        crossingEntries[cursor[crossingIndex(info.crossing)]++] = i;
+    }
+  }
+
+  size_t crossingIndex(const sCrossing *crossing) const { return static_cast<size_t>(crossing - crossingsBase); }
+
+  int cellOf(int coord) const {
+    // floor division, cars spawn at negative coordinates
+    return coord >= 0 ? coord / cellSize : -((-coord + cellSize - 1) / cellSize);
+  }
+
+  size_t bucketOf(int cx, int cy) const {
+    return (static_cast<size_t>(static_cast<unsigned>(cx) * 73856093u) ^ static_cast<size_t>(static_cast<unsigned>(cy) * 19349663u)) & bucketMask;
+  }
+
+  // Cells covering [p1, p2) so that strictly overlapping rects always share a cell
+  template <typename F>
+  void forEachBucket(const sRect &rect, F fn) const {
+    if (rect.width() <= 0 || rect.height() <= 0)
+      return;
+    int cx0 = cellOf(rect.p1.x), cx1 = cellOf(rect.p2.x - 1);
+    int cy0 = cellOf(rect.p1.y), cy1 = cellOf(rect.p2.y - 1);
+    for (int cy = cy0; cy <= cy1; ++cy) {
+      for (int cx = cx0; cx <= cx1; ++cx) {
+        fn(bucketOf(cx, cy));
+      }
+    }
+  }
+};
+
+// Sort-and-sweep over car rects, split by the axis cars travel along.
+// Horizontal movers are kept sorted by (p1.y, p1.x) and vertical ones by
+// (p1.x, p1.y), so each class is a list of lanes ordered along the lane and a
+// rect query is a binary search per lane in range. A car pushed back along its
+// own direction stays in its lane and is re-sorted in place.
+struct sSweepAndPrune {
+  struct sEntry {
+    int lane, travel;
+    size_t index;
+
+    bool operator<(const sEntry &other) const { return lane < other.lane || (lane == other.lane && travel < other.travel); }
+  };
+
+  struct sAxisClass {
+    bool horizontal;
+    int maxLaneExtent = 0, maxTravelExtent = 0;
+    std::vector<sEntry> entries;
+
+    explicit sAxisClass(bool horizontal) : horizontal(horizontal) {}
+
+    int laneOf(const sRect &rect) const { return horizontal ? rect.p1.y : rect.p1.x; }
+    int travelOf(const sRect &rect) const { return horizontal ? rect.p1.x : rect.p1.y; }
+    int laneExtent(const sRect &rect) const { return horizontal ? rect.height() : rect.width(); }
+    int travelExtent(const sRect &rect) const { return horizontal ? rect.width() : rect.height(); }
+  };
+
+  sAxisClass classes[2] = {sAxisClass(true), sAxisClass(false)};
+  std::vector<unsigned char> classOf;
+  std::vector<size_t> slotOf;
+
+  static bool isHorizontal(const sVec &direction) { return direction.y == 0; }
+
+  void rebuild(const sCarStore &cars) {
+    for (auto &axisClass : classes) {
+      // respawns move cars between classes, so each may need room for all of them
+      axisClass.entries.reserve(cars.size());
+      axisClass.entries.clear();
+      axisClass.maxLaneExtent = 0;
+      axisClass.maxTravelExtent = 0;
+    }
+    classOf.resize(cars.size());
+    slotOf.resize(cars.size());
+
+    for (size_t i = 0; i < cars.size(); ++i) {
+      classOf[i] = isHorizontal(cars.directions[i]) ? 0 : 1;
+      auto &axisClass = classes[classOf[i]];
+      sRect rect = cars.rect(i);
+      axisClass.entries.push_back(sEntry{axisClass.laneOf(rect), axisClass.travelOf(rect), i});
+      axisClass.maxLaneExtent = std::max(axisClass.maxLaneExtent, axisClass.laneExtent(rect));
+      axisClass.maxTravelExtent = std::max(axisClass.maxTravelExtent, axisClass.travelExtent(rect));
+    }
+
+    for (auto &axisClass : classes) {
+      std::sort(axisClass.entries.begin(), axisClass.entries.end());
+      for (size_t slot = 0; slot < axisClass.entries.size(); ++slot) {
+        slotOf[axisClass.entries[slot].index] = slot;
+      }
+    }
+  }
+
+  // Re-sorts a car after its rect moved along its lane
+  void update(size_t index, const sRect &rect) {
+    auto &axisClass = classes[classOf[index]];
+    auto &entries = axisClass.entries;
+    size_t slot = slotOf[index];
+    entries[slot].travel = axisClass.travelOf(rect);
+    while (slot > 0 && entries[slot] < entries[slot - 1]) {
+      swapSlots(axisClass, slot, slot - 1);
+      --slot;
+    }
+    while (slot + 1 < entries.size() && entries[slot + 1] < entries[slot]) {
+      swapSlots(axisClass, slot, slot + 1);
+      ++slot;
+    }
+  }
+
+  // Calls fn(index) for every car whose p1 lies close enough to the rect to
+  // overlap it; callers still do the exact rect test
+  template <typename F>
+  void forEachCandidate(const sRect &rect, F fn) const {
+    for (auto &axisClass : classes) {
+      if (axisClass.entries.empty())
+        continue;
+
+      int laneBegin = axisClass.laneOf(rect) - axisClass.maxLaneExtent + 1;
+      int laneEnd = axisClass.laneOf(rect) + axisClass.laneExtent(rect);
+      int travelBegin = axisClass.travelOf(rect) - axisClass.maxTravelExtent + 1;
+      int travelEnd = axisClass.travelOf(rect) + axisClass.travelExtent(rect);
+
+      auto it = std::lower_bound(axisClass.entries.begin(), axisClass.entries.end(), sEntry{laneBegin, std::numeric_limits<int>::min(), 0});
+      while (it != axisClass.entries.end() && it->lane < laneEnd) {
+        int lane = it->lane;
+        it = std::lower_bound(it, axisClass.entries.end(), sEntry{lane, travelBegin, 0});
+        for (; it != axisClass.entries.end() && it->lane == lane && it->travel < travelEnd; ++it) {
+          fn(it->index);
+        }
+        if (lane == std::numeric_limits<int>::max())
+          break;
+        it = std::lower_bound(it, axisClass.entries.end(), sEntry{lane + 1, std::numeric_limits<int>::min(), 0});
+      }
+    }
+  }
+
+ private:
+  void swapSlots(sAxisClass &axisClass, size_t a, size_t b) {
+    std::swap(axisClass.entries[a], axisClass.entries[b]);
+    slotOf[axisClass.entries[a].index] = a;
+    slotOf[axisClass.entries[b].index] = b;
+  }
+};
+
+// Cars split by the direction they travel in, each direction sorted by lane
+// (p1 across the direction) and then along the lane, so the car a car follows
+// is its neighbour in the list. The order is kept between ticks: cars moving
+// along their lane are re-sorted in place, and only those that changed lane or
+// direction (respawns) are sorted apart and merged back in.
+struct sLaneIndex {
+  typedef sSweepAndPrune::sEntry sEntry;
+
+  struct sLaneRun {
+    int lane;
+    size_t begin, end;
+  };
+
+  struct sDirectionClass {
+    bool horizontal;
+    int maxLaneExtent = 0, maxTravelExtent = 0;
+    std::vector<sEntry> entries;
+    std::vector<sLaneRun> lanes;
+
+    explicit sDirectionClass(bool horizontal) : horizontal(horizontal) {}
+
+    int laneOf(const sRect &rect) const { return horizontal ? rect.p1.y : rect.p1.x; }
+    int travelOf(const sRect &rect) const { return horizontal ? rect.p1.x : rect.p1.y; }
+    int laneExtent(const sRect &rect) const { return horizontal ? rect.height() : rect.width(); }
+    int travelExtent(const sRect &rect) const { return horizontal ? rect.width() : rect.height(); }
+  };
+
+  // Where a car currently sorts, read from the store in index order once per refresh
+  struct sKey {
+    int lane, travel;
+    unsigned char directionClass;
+  };
+
+  // East, west, south, north
+  sDirectionClass classes[4] = {sDirectionClass(true), sDirectionClass(true), sDirectionClass(false), sDirectionClass(false)};
+  std::vector<sKey> keys;
+  std::vector<size_t> slotOf;
+
+  static unsigned char classFor(const sVec &direction) { return direction.y == 0 ? (direction.x > 0 ? 0 : 1) : (direction.y > 0 ? 2 : 3); }
+
+  void refresh(const sCarStore &cars) {
+    if (keys.size() != cars.size()) {
+      rebuild(cars);
+      return;
+    }
+    readKeys(cars);
+
+    moved.clear();
+    for (unsigned char c = 0; c < 4; ++c) {
+      auto &entries = classes[c].entries;
+      size_t kept = 0;
+      for (auto &entry : entries) {
+        const sKey &key = keys[entry.index];
+        if (key.directionClass != c || key.lane != entry.lane) {
+          moved.push_back(sEntry{key.lane, key.travel, entry.index});
+          continue;
+        }
+        entries[kept++] = sEntry{entry.lane, key.travel, entry.index};
+      }
+      entries.resize(kept);
+      // cars that kept their lane moved by about the same step, so few are out of order
+      for (size_t slot = 1; slot < entries.size(); ++slot) {
+        for (size_t k = slot; k > 0 && entries[k] < entries[k - 1]; --k) {
+          std::swap(entries[k], entries[k - 1]);
+        }
+      }
+    }
+
+    auto classOf = [&](const sEntry &entry) { return keys[entry.index].directionClass; };
+    std::sort(moved.begin(), moved.end(), [&](const sEntry &a, const sEntry &b) { return classOf(a) < classOf(b) || (classOf(a) == classOf(b) && a < b); });
+    auto movedBegin = moved.begin();
+    for (unsigned char c = 0; c < 4; ++c) {
+      auto movedEnd = std::find_if(movedBegin, moved.end(), [&](const sEntry &entry) { return classOf(entry) != c; });
+      if (movedEnd == movedBegin)
+        continue;
+      auto &entries = classes[c].entries;
+      merged.resize(entries.size() + (movedEnd - movedBegin));
+      std::merge(entries.begin(), entries.end(), movedBegin, movedEnd, merged.begin());
+      entries.swap(merged);
+      movedBegin = movedEnd;
+    }
+    index();
+  }
+
+  // Calls fn(index) for every car going the same way as the given one (in the
+  // given direction, which the caller already has at hand) whose p1
+  // lies close enough to the rect to overlap it; callers still do the exact
+  // rect test. Within the car's own lane the scan starts from its slot, so a rect
+  // just ahead of the car only reaches its leader.
+  template <typename F>
+  void forEachCandidate(size_t car, const sVec &direction, const sRect &rect, F fn) const {
+    auto &directionClass = classes[classFor(direction)];
+    auto &entries = directionClass.entries;
+    int laneBegin = directionClass.laneOf(rect) - directionClass.maxLaneExtent + 1;
+    int laneEnd = directionClass.laneOf(rect) + directionClass.laneExtent(rect);
+    int travelBegin = directionClass.travelOf(rect) - directionClass.maxTravelExtent + 1;
+    int travelEnd = directionClass.travelOf(rect) + directionClass.travelExtent(rect);
+
+    size_t slot = slotOf[car];
+    int ownLane = entries[slot].lane;
+    auto run = std::lower_bound(directionClass.lanes.begin(), directionClass.lanes.end(), laneBegin, [](const sLaneRun &run, int lane) { return run.lane < lane; });
+    for (; run != directionClass.lanes.end() && run->lane < laneEnd; ++run) {
+      if (run->lane != ownLane) {
+        auto it = std::lower_bound(entries.begin() + run->begin, entries.begin() + run->end, sEntry{run->lane, travelBegin, 0});
+        for (; it != entries.begin() + run->end && it->travel < travelEnd; ++it) {
+          fn(it->index);
+        }
+        continue;
+      }
+      for (size_t k = slot + 1; k < run->end && entries[k].travel < travelEnd; ++k) {
+        if (entries[k].travel >= travelBegin)
+          fn(entries[k].index);
+      }
+      for (size_t k = slot; k > run->begin && entries[k - 1].travel >= travelBegin; --k) {
+        if (entries[k - 1].travel < travelEnd)
+          fn(entries[k - 1].index);
+      }
+    }
+  }
+
+ private:
+  std::vector<sEntry> moved, merged;
+
+  void rebuild(const sCarStore &cars) {
+    // respawns move cars between classes, so each may need room for all of them
+    moved.reserve(cars.size());
+    merged.reserve(cars.size());
+    for (auto &directionClass : classes) {
+      directionClass.entries.reserve(cars.size());
+      directionClass.lanes.reserve(cars.size());
+      directionClass.entries.clear();
+    }
+    keys.resize(cars.size());
+    slotOf.resize(cars.size());
+
+    readKeys(cars);
+    for (size_t i = 0; i < cars.size(); ++i) {
+      classes[keys[i].directionClass].entries.push_back(sEntry{keys[i].lane, keys[i].travel, i});
+    }
+    for (auto &directionClass : classes) {
+      std::sort(directionClass.entries.begin(), directionClass.entries.end());
+    }
+    index();
+  }
+
+  void readKeys(const sCarStore &cars) {
+    for (auto &directionClass : classes) {
+      directionClass.maxLaneExtent = 0;
+      directionClass.maxTravelExtent = 0;
+    }
+    for (size_t i = 0; i < cars.size(); ++i) {
+      unsigned char c = classFor(cars.directions[i]);
+      auto &directionClass = classes[c];
+      sRect rect = cars.rect(i);
+      keys[i] = sKey{directionClass.laneOf(rect), directionClass.travelOf(rect), c};
+      directionClass.maxLaneExtent = std::max(directionClass.maxLaneExtent, directionClass.laneExtent(rect));
+      directionClass.maxTravelExtent = std::max(directionClass.maxTravelExtent, directionClass.travelExtent(rect));
+    }
+  }
+
+  // Slots and lane runs of the sorted classes
+  void index() {
+    for (auto &directionClass : classes) {
+      auto &entries = directionClass.entries;
+      directionClass.lanes.clear();
+      for (size_t slot = 0; slot < entries.size(); ++slot) {
+        slotOf[entries[slot].index] = slot;
+        if (directionClass.lanes.empty() || directionClass.lanes.back().lane != entries[slot].lane)
+          directionClass.lanes.push_back(sLaneRun{entries[slot].lane, slot, slot});
+        directionClass.lanes.back().end = slot + 1;
+      }
+    }
+  }
+};
+
+#endif  // MYTONA_SPATIAL_HPP
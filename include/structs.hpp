@@ -3,15 +3,20 @@
 
 #include <vector>
 #include <deque>
+#include <set>
 #include <algorithm>
 #include <cstdlib>
-#include <ctime>
+#include <cstdint>
 #include <limits>
+#include <stdexcept>
+#include <utility>
 
 struct sVec;
 struct sRect;
 struct sLineSegment;
+struct sCarState;
 struct sCar;
+struct sCarStore;
 struct sCrossingCarInfo;
 struct sCrossing;
 struct sRoadData;
@@ -171,11 +176,13 @@ struct sRect {
 
   bool isInsideOrOnEdge(const sVec &vec) const { return isInside(vec) || isOnEdge(vec); }
 
+  // Shares an edge or a corner: a coinciding edge coordinate only counts when
+  // the spans along the other axis meet too
   bool touches(const sRect &other) const {
-    return p1.x == other.p2.x ||  //
-           p2.x == other.p1.x ||  //
-           p1.y == other.p2.y ||  //
-           p2.y == other.p1.y;    //
+    bool xSpansMeet = p1.x <= other.p2.x && p2.x >= other.p1.x;
+    bool ySpansMeet = p1.y <= other.p2.y && p2.y >= other.p1.y;
+    return ((p1.x == other.p2.x || p2.x == other.p1.x) && ySpansMeet) ||  //
+           ((p1.y == other.p2.y || p2.y == other.p1.y) && xSpansMeet);    //
   }
 
   bool overlaps(const sRect &other) const {
@@ -193,6 +200,9 @@ struct sLineSegment {
 
   sLineSegment(sVec p1, sVec p2) : p1(p1), p2(p2) {}
 
+  bool operator==(const sLineSegment &other) const { return p1 == other.p1 && p2 == other.p2; }
+  bool operator!=(const sLineSegment &other) const { return !(*this == other); }
+
   float slope() const {
     if (p1.x == p2.x)
       return std::numeric_limits<float>::infinity();
@@ -216,6 +226,149 @@ struct sLineSegment {
     intersectionPoint->y = (a1 * c2 - a2 * c1) / det;
     return true;
   }
+
+  // The segments themselves meet, ends included; unlike intersects, which
+  // extends both into lines. Collinear overlaps count here.
+  bool meets(const sLineSegment &other) const {
+    int64_t d1 = orientation(other.p1, other.p2, p1), d2 = orientation(other.p1, other.p2, p2);
+    int64_t d3 = orientation(p1, p2, other.p1), d4 = orientation(p1, p2, other.p2);
+    return ((d1 <= 0 && d2 >= 0) || (d1 >= 0 && d2 <= 0)) && ((d3 <= 0 && d4 >= 0) || (d3 >= 0 && d4 <= 0));
+  }
+
+  bool isHorizontal() const { return p1.y == p2.y && p1.x != p2.x; }
+  bool isVertical() const { return p1.x == p2.x && p1.y != p2.y; }
+
+ private:
+  static int64_t orientation(const sVec &from, const sVec &to, const sVec &point) {
+    return static_cast<int64_t>(to.x - from.x) * (point.y - from.y) - static_cast<int64_t>(to.y - from.y) * (point.x - from.x);
+  }
+};
+
+// Where two road segments i < j cross
+struct sSegmentCrossing {
+  size_t first, second;
+  sVec point;
+
+  bool operator<(const sSegmentCrossing &other) const { return first < other.first || (first == other.first && second < other.second); }
+};
+
+// Every point where segments really cross, with the first pair of segments
+// crossing there in the order of their indices, as a pairwise scan would
+// find it. Roads split into pieces end to end meet at a node in several
+// pairs; they make one crossing. Horizontal and vertical segments meet
+// in a sweep along x: a horizontal one is live between its ends and each
+// vertical one collects the live rows within its span. Parallel segments never
+// cross, as with intersects. Segments along no axis are tested against all
+// the others.
+std::vector<sSegmentCrossing> findSegmentCrossings(const std::vector<sLineSegment> &segments) {
+  enum eEventKind { ROW_STARTS, COLUMN, ROW_ENDS };
+  struct sEvent {
+    int x;
+    eEventKind kind;
+    size_t segment;
+
+    bool operator<(const sEvent &other) const { return x < other.x || (x == other.x && kind < other.kind); }
+  };
+
+  std::vector<sEvent> events;
+  std::vector<size_t> others;
+  for (size_t s = 0; s < segments.size(); ++s) {
+    const sLineSegment &segment = segments[s];
+    if (segment.isHorizontal()) {
+      events.push_back(sEvent{std::min(segment.p1.x, segment.p2.x), ROW_STARTS, s});
+      events.push_back(sEvent{std::max(segment.p1.x, segment.p2.x), ROW_ENDS, s});
+    } else if (segment.isVertical()) {
+      events.push_back(sEvent{segment.p1.x, COLUMN, s});
+    } else {
+      others.push_back(s);
+    }
+  }
+  std::sort(events.begin(), events.end());
+
+  std::vector<sSegmentCrossing> found;
+  std::set<std::pair<int, size_t>> liveRows;
+  for (auto &event : events) {
+    const sLineSegment &segment = segments[event.segment];
+    if (event.kind == ROW_STARTS) {
+      liveRows.insert(std::make_pair(segment.p1.y, event.segment));
+    } else if (event.kind == ROW_ENDS) {
+      liveRows.erase(std::make_pair(segment.p1.y, event.segment));
+    } else {
+      int y1 = std::min(segment.p1.y, segment.p2.y), y2 = std::max(segment.p1.y, segment.p2.y);
+      for (auto row = liveRows.lower_bound(std::make_pair(y1, size_t(0))); row != liveRows.end() && row->first <= y2; ++row) {
+        found.push_back(sSegmentCrossing{std::min(row->second, event.segment), std::max(row->second, event.segment), sVec(event.x, row->first)});
+      }
+    }
+  }
+
+  sVec intersectionPoint;
+  for (size_t o = 0; o < others.size(); ++o) {
+    for (size_t s = 0; s < segments.size(); ++s) {
+      // pairs of two such segments are seen from the lower one only
+      bool isOther = std::binary_search(others.begin(), others.end(), s);
+      if (s == others[o] || (isOther && s < others[o]))
+        continue;
+      const sLineSegment &a = segments[std::min(s, others[o])], &b = segments[std::max(s, others[o])];
+      if (a.meets(b) && a.intersects(b, &intersectionPoint))
+        found.push_back(sSegmentCrossing{std::min(s, others[o]), std::max(s, others[o]), intersectionPoint});
+    }
+  }
+
+  std::sort(found.begin(), found.end());
+  std::set<std::pair<int, int>> points;
+  found.erase(std::remove_if(found.begin(), found.end(), [&](const sSegmentCrossing &crossing) { return !points.insert(std::make_pair(crossing.point.x, crossing.point.y)).second; }),
+              found.end());
+  return found;
+}
+
+// xoshiro128** seeded through splitmix64. Small enough to give every car or
+// worker its own stream: sRandom(seed, stream) derives independent streams
+// from one seed, and split() forks a child off an existing generator.
+struct sRandom {
+  uint32_t state[4];
+
+  explicit sRandom(uint64_t seed = 0, uint64_t stream = 0) { reseed(seed, stream); }
+
+  void reseed(uint64_t seed, uint64_t stream = 0) {
+    uint64_t mix = seed ^ (stream * 0xD1B54A32D192ED03ull);
+    uint64_t a = splitMix64(mix), b = splitMix64(mix);
+    state[0] = static_cast<uint32_t>(a);
+    state[1] = static_cast<uint32_t>(a >> 32);
+    state[2] = static_cast<uint32_t>(b);
+    state[3] = static_cast<uint32_t>(b >> 32);
+    if ((state[0] | state[1] | state[2] | state[3]) == 0)
+      state[0] = 1;
+  }
+
+  uint32_t next() {
+    uint32_t result = rotl(state[1] * 5, 7) * 9;
+    uint32_t t = state[1] << 9;
+    state[2] ^= state[0];
+    state[3] ^= state[1];
+    state[1] ^= state[2];
+    state[0] ^= state[3];
+    state[2] ^= t;
+    state[3] = rotl(state[3], 11);
+    return result;
+  }
+
+  // Uniform in [0, bound)
+  uint32_t nextBelow(uint32_t bound) { return static_cast<uint32_t>((static_cast<uint64_t>(next()) * bound) >> 32); }
+
+  sRandom split() {
+    uint64_t seed = (static_cast<uint64_t>(next()) << 32) | next();
+    return sRandom(seed);
+  }
+
+ private:
+  static uint32_t rotl(uint32_t x, int k) { return (x << k) | (x >> (32 - k)); }
+
+  static uint64_t splitMix64(uint64_t &x) {
+    uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
 };
 
 enum eCarAlignment {
@@ -225,7 +378,14 @@ enum eCarAlignment {
   CAR_MOVE_SOUTH,
 };
 
-struct sCar {
+enum eCarKind : unsigned char {
+  CAR_KIND_GAS,
+  CAR_KIND_ELECTRO,
+  CAR_KIND_HYBRID,
+  CAR_KIND_COUNT,
+};
+
+struct sCarState {
   sRect rect;
   sVec direction;
   int speed = 1;
@@ -233,9 +393,7 @@ struct sCar {
   bool checkSides = true;
   bool debuggee = false;
 
-  virtual ~sCar() = default;
-
-  sCar &setAlignment(eCarAlignment alignment) {
+  sCarState &setAlignment(eCarAlignment alignment) {
     switch (alignment) {
       case eCarAlignment::CAR_MOVE_WEST:
         if (rect.height() > rect.width()) {
@@ -293,6 +451,13 @@ struct sCar {
     return sVec(rect.x() + rect.size().x / 2 + rect.size().x * direction.x / 2,  //
                 rect.y() + rect.size().y / 2 + rect.size().y * direction.y / 2);
   }
+};
+
+struct sCar : public sCarState {
+  // Concrete type, so per-frame code can branch on it without RTTI
+  eCarKind kind = CAR_KIND_GAS;
+
+  virtual ~sCar() = default;
 
   virtual void move() {}
   virtual int getFuel() = 0;
@@ -300,7 +465,9 @@ struct sCar {
 };
 
 struct sGasCar : public virtual sCar {
-  int fuel;
+  int fuel = 0;
+
+  sGasCar() { kind = CAR_KIND_GAS; }
 
   int getFuel() { return fuel; }
 
@@ -313,7 +480,9 @@ struct sGasCar : public virtual sCar {
 };
 
 struct sElectroCar : public virtual sCar {
-  int charge;
+  int charge = 0;
+
+  sElectroCar() { kind = CAR_KIND_ELECTRO; }
 
   int getFuel() { return charge; }
 
@@ -326,6 +495,11 @@ struct sElectroCar : public virtual sCar {
 };
 
 struct sHybridCar : public sGasCar, public sElectroCar {
+  // Picks which tank a move drains, a stream of its own so cars stay independent
+  sRandom random;
+
+  sHybridCar() { kind = CAR_KIND_HYBRID; }
+
   void refill(int count) {
     charge += count / 2;
     fuel += count / 2;
@@ -334,7 +508,7 @@ struct sHybridCar : public sGasCar, public sElectroCar {
   int getFuel() { return charge + fuel; }
 
   void move() {
-    if (rand() % 2 == 0)
+    if (random.nextBelow(2) == 0)
       --charge;
     else
       --fuel;
@@ -342,8 +516,225 @@ struct sHybridCar : public sGasCar, public sElectroCar {
   }
 };
 
+// Cars laid out as parallel arrays addressed by a dense index, so the
+// simulator passes walk memory linearly instead of chasing sCar pointers
+// through the virtual base. The store owns the simulation state; the sCar
+// objects stay as handles for the concrete type and fuel, and their own
+// sCarState is a copy taken at push_back and refreshed by syncToCars().
+struct sCarStore {
+  enum eFlags : unsigned char {
+    WAS_IN_FIELD = 1 << 0,
+    CHECK_SIDES = 1 << 1,
+    DEBUGGEE = 1 << 2,
+  };
+
+  std::vector<int> x, y;
+  std::vector<sVec> sizes;
+  std::vector<sVec> directions;
+  std::vector<int> speeds;
+  std::vector<unsigned char> flags;
+  std::vector<eCarKind> kinds;
+  std::vector<int> crossings;      // crossing the car is registered in, or -1
+  std::vector<int> crossingSlots;  // its slot in that crossing's sCrossingCars
+  std::vector<sCar *> handles;
+
+  size_t size() const { return handles.size(); }
+  bool empty() const { return handles.empty(); }
+
+  sCar *operator[](size_t i) const { return handles[i]; }
+  std::vector<sCar *>::const_iterator begin() const { return handles.begin(); }
+  std::vector<sCar *>::const_iterator end() const { return handles.end(); }
+
+  void push_back(sCar *car) {
+    x.push_back(0);
+    y.push_back(0);
+    sizes.emplace_back();
+    directions.emplace_back();
+    speeds.push_back(0);
+    flags.push_back(0);
+    kinds.push_back(car->kind);
+    crossings.push_back(-1);
+    crossingSlots.push_back(-1);
+    handles.push_back(car);
+    setState(handles.size() - 1, *car);
+  }
+
+  void clear() {
+    x.clear();
+    y.clear();
+    sizes.clear();
+    directions.clear();
+    speeds.clear();
+    flags.clear();
+    kinds.clear();
+    crossings.clear();
+    crossingSlots.clear();
+    handles.clear();
+  }
+
+  sVec position(size_t i) const { return sVec(x[i], y[i]); }
+  sRect rect(size_t i) const { return sRect(sVec(x[i], y[i]), sizes[i].x, sizes[i].y); }
+
+  bool hasFlag(size_t i, eFlags flag) const { return (flags[i] & flag) != 0; }
+
+  void setFlag(size_t i, eFlags flag, bool value) {
+    if (value)
+      flags[i] |= flag;
+    else
+      flags[i] &= ~flag;
+  }
+
+  void moveBy(size_t i, const sVec &vec) {
+    x[i] += vec.x;
+    y[i] += vec.y;
+  }
+
+  void moveTo(size_t i, const sVec &vec) {
+    x[i] = vec.x;
+    y[i] = vec.y;
+  }
+
+  sCarState state(size_t i) const {
+    sCarState car;
+    car.rect = rect(i);
+    car.direction = directions[i];
+    car.speed = speeds[i];
+    car.wasInField = hasFlag(i, WAS_IN_FIELD);
+    car.checkSides = hasFlag(i, CHECK_SIDES);
+    car.debuggee = hasFlag(i, DEBUGGEE);
+    return car;
+  }
+
+  void setState(size_t i, const sCarState &car) {
+    x[i] = car.rect.x();
+    y[i] = car.rect.y();
+    sizes[i] = car.rect.size();
+    directions[i] = car.direction;
+    speeds[i] = car.speed;
+    setFlag(i, WAS_IN_FIELD, car.wasInField);
+    setFlag(i, CHECK_SIDES, car.checkSides);
+    setFlag(i, DEBUGGEE, car.debuggee);
+  }
+
+  // Same as the sCarState ones, read straight from the arrays
+  sRect forwardRect(size_t i) const { return sRect(sVec(x[i] + directions[i].x * sizes[i].x, y[i] + directions[i].y * sizes[i].y), sizes[i].x, sizes[i].y); }
+  sRect futureRect(size_t i) const { return sRect(futurePosition(i), sizes[i].x, sizes[i].y); }
+  sVec futurePosition(size_t i) const { return sVec(x[i] + directions[i].x * speeds[i], y[i] + directions[i].y * speeds[i]); }
+  sVec frontPoint(size_t i) const {
+    return sVec(x[i] + sizes[i].x / 2 + sizes[i].x * directions[i].x / 2,  //
+                y[i] + sizes[i].y / 2 + sizes[i].y * directions[i].y / 2);
+  }
+
+  // Copies the store state back into the sCar handles for code that works on whole cars
+  void syncToCars() {
+    for (size_t i = 0; i < handles.size(); ++i) {
+      static_cast<sCarState &>(*handles[i]) = state(i);
+    }
+  }
+};
+
+// Cars registered in a crossing, in the order they entered. Every car keeps
+// its slot in sCarStore::crossingSlots, so entering appends and leaving just
+// clears that slot; cleared slots are squeezed out once the tail is full.
+// Order is kept because isDeadlocked and resolveDeadlocks depend on it.
+// Slots live in place up to CAPACITY; a crossing crowded past that, by a wide
+// lane or cars pushed into each other, moves them to the heap until it empties.
+struct sCrossingCars {
+  enum : size_t { CAPACITY = 64 };
+  enum : unsigned { NO_CAR = std::numeric_limits<unsigned>::max() };
+
+  size_t used = 0;
+  size_t count = 0;
+
+  struct const_iterator {
+    const unsigned *slot, *last;
+
+    const_iterator(const unsigned *slot, const unsigned *last) : slot(slot), last(last) { skipEmpty(); }
+
+    size_t operator*() const { return *slot; }
+    bool operator!=(const const_iterator &other) const { return slot != other.slot; }
+
+    const_iterator &operator++() {
+      ++slot;
+      skipEmpty();
+      return *this;
+    }
+
+   private:
+    void skipEmpty() {
+      while (slot != last && *slot == NO_CAR) {
+        ++slot;
+      }
+    }
+  };
+
+  const_iterator begin() const { return const_iterator(slots(), slots() + used); }
+  const_iterator end() const { return const_iterator(slots() + used, slots() + used); }
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  void insert(sCarStore &store, size_t car) {
+    if (used == capacity())
+      compact(store);
+    if (used == capacity())
+      grow();
+    store.crossingSlots[car] = used;
+    slots()[used++] = static_cast<unsigned>(car);
+    ++count;
+  }
+
+  void erase(sCarStore &store, size_t car) {
+    int slot = store.crossingSlots[car];
+    if (slot < 0)
+      return;
+    slots()[slot] = NO_CAR;
+    store.crossingSlots[car] = -1;
+    --count;
+    if (count == 0) {
+      used = 0;
+      spilled.clear();
+    }
+  }
+
+  template <typename Compare>
+  void sort(sCarStore &store, Compare compare) {
+    compact(store);
+    std::sort(slots(), slots() + used, compare);
+    for (size_t slot = 0; slot < used; ++slot) {
+      store.crossingSlots[slots()[slot]] = slot;
+    }
+  }
+
+ private:
+  unsigned local[CAPACITY];
+  std::vector<unsigned> spilled;  // every slot while more than CAPACITY are needed
+
+  unsigned *slots() { return spilled.empty() ? local : spilled.data(); }
+  const unsigned *slots() const { return spilled.empty() ? local : spilled.data(); }
+  size_t capacity() const { return spilled.empty() ? static_cast<size_t>(CAPACITY) : spilled.size(); }
+
+  void grow() {
+    std::vector<unsigned> grown(2 * capacity(), NO_CAR);
+    std::copy(slots(), slots() + used, grown.begin());
+    spilled.swap(grown);
+  }
+
+  void compact(sCarStore &store) {
+    unsigned *slot = slots();
+    size_t live = 0;
+    for (size_t i = 0; i < used; ++i) {
+      if (slot[i] != NO_CAR) {
+        slot[live] = slot[i];
+        store.crossingSlots[slot[live]] = live;
+        ++live;
+      }
+    }
+    used = live;
+  }
+};
+
 struct sCrossingCarInfo {
-  sCar *car;
+  size_t car;
   sCrossing *crossing;
   bool isInCrossing;
   bool isTouched;
@@ -352,34 +743,30 @@ struct sCrossingCarInfo {
 
 struct sCrossing {
   sRect rect;
-  std::vector<sCar *> cars;
+  sCrossingCars cars;
 
   explicit sCrossing(sRect rect) : rect(rect) {}
 
-  sCrossingCarInfo getCrossingInfo(const sCar *car) const {
-    sCrossingCarInfo info{const_cast<sCar *>(car), const_cast<sCrossing *>(this), false, false, false};
-    info.isInCrossing = car->rect.contacts(rect);
+  sCrossingCarInfo getCrossingInfo(const sCarStore &store, size_t car) const {
+    sCrossingCarInfo info{car, const_cast<sCrossing *>(this), false, false, false};
+    sRect carRect = store.rect(car);
+    info.isInCrossing = carRect.contacts(rect);
     if (info.isInCrossing) {
-      sVec frontPoint = car->frontPoint();
-      info.isTouched = car->rect.touches(rect) && rect.isInsideOrOnEdge(frontPoint);
-      info.justWentOut = car->rect.touches(rect) && !rect.isInsideOrOnEdge(frontPoint);
+      sVec frontPoint = store.frontPoint(car);
+      info.isTouched = carRect.touches(rect) && rect.isInsideOrOnEdge(frontPoint);
+      info.justWentOut = carRect.touches(rect) && !rect.isInsideOrOnEdge(frontPoint);
     }
     return info;
   }
 
-  void updateCarData(sCar *car) {
-    auto crossingInfo = getCrossingInfo(car);
-    auto foundCarIt = std::find(cars.begin(), cars.end(), car);
-    bool infoStored = foundCarIt != cars.end();
-    if (crossingInfo.isInCrossing && !infoStored) {
-      cars.push_back(car);
-    } else if (!crossingInfo.isInCrossing && infoStored) {
-      cars.erase(foundCarIt);
-      car->checkSides = true;
-    }
+  void addCar(sCarStore &store, size_t car) { cars.insert(store, car); }
+
+  void removeCar(sCarStore &store, size_t car) {
+    cars.erase(store, car);
+    store.setFlag(car, sCarStore::CHECK_SIDES, true);
   }
 
-  bool isDeadlocked() const {
+  bool isDeadlocked(const sCarStore &store) const {
     bool                //
     hasLeft = false,    //
     hasRight = false,   //
@@ -387,20 +774,21 @@ struct sCrossing {
     hasBottom = false,  //
     hasNoChecker = false;
 
-    for (auto *car : cars) {
-      sCrossingCarInfo crossingInfo = getCrossingInfo(car);
+    for (auto car : cars) {
+      sCrossingCarInfo crossingInfo = getCrossingInfo(store, car);
+      const sVec &direction = store.directions[car];
       if (hasLeft && hasRight && hasTop && hasBottom)
         return true;
-      if (car->direction.x < 0) {
+      if (direction.x < 0) {
         hasRight = crossingInfo.isTouched;
-      } else if (car->direction.x > 0) {
+      } else if (direction.x > 0) {
         hasLeft = crossingInfo.isTouched;
-      } else if (car->direction.y < 0) {
+      } else if (direction.y < 0) {
         hasTop = crossingInfo.isTouched;
-      } else if (car->direction.y > 0) {
+      } else if (direction.y > 0) {
         hasBottom = crossingInfo.isTouched;
       }
-      if (!car->checkSides) {
+      if (!store.hasFlag(car, sCarStore::CHECK_SIDES)) {
         hasNoChecker = true;
       }
     }
@@ -408,6 +796,125 @@ struct sCrossing {
   }
 };
 
+// Crossings grouped by the lines of the axis-aligned road segments they lie
+// on, each group sorted along its line. A car moving along x can only contact
+// crossings of horizontal lines within a lane of its own row, so it looks up
+// those lines by their y and then the few crossings around its x by binary
+// search. Crossings not made of a horizontal and a vertical segment can't be
+// located that way and are checked for every car.
+struct sCrossingIndex {
+  struct sSegmentCrossings {
+    int coord;
+    std::vector<size_t> crossings;
+  };
+
+  int laneSize = 0;
+  int maxCrossingSize = 0;
+  std::vector<sSegmentCrossings> horizontal, vertical;
+  std::vector<size_t> loose;
+
+  void build(int laneSize, const std::vector<sLineSegment> &segments, const std::vector<sCrossing> &crossings,
+             const std::vector<std::pair<size_t, size_t>> &crossingSegments) {
+    this->laneSize = laneSize;
+    maxCrossingSize = 0;
+    horizontal.clear();
+    vertical.clear();
+    loose.clear();
+
+    std::vector<int> segmentSlot(segments.size(), -1);
+    for (size_t s = 0; s < segments.size(); ++s) {
+      if (segments[s].isHorizontal()) {
+        segmentSlot[s] = horizontal.size();
+        horizontal.push_back(sSegmentCrossings{segments[s].p1.y, {}});
+      } else if (segments[s].isVertical()) {
+        segmentSlot[s] = vertical.size();
+        vertical.push_back(sSegmentCrossings{segments[s].p1.x, {}});
+      }
+    }
+
+    for (size_t c = 0; c < crossings.size(); ++c) {
+      maxCrossingSize = std::max(maxCrossingSize, std::max(crossings[c].rect.width(), crossings[c].rect.height()));
+      size_t s1 = crossingSegments[c].first, s2 = crossingSegments[c].second;
+      if (segments[s1].isVertical() && segments[s2].isHorizontal())
+        std::swap(s1, s2);
+      if (segments[s1].isHorizontal() && segments[s2].isVertical()) {
+        horizontal[segmentSlot[s1]].crossings.push_back(c);
+        vertical[segmentSlot[s2]].crossings.push_back(c);
+      } else {
+        loose.push_back(c);
+      }
+    }
+
+    mergeCollinear(horizontal);
+    mergeCollinear(vertical);
+    for (auto &segment : horizontal) {
+      std::sort(segment.crossings.begin(), segment.crossings.end(), [&](size_t c1, size_t c2) { return crossings[c1].rect.x() < crossings[c2].rect.x(); });
+    }
+    for (auto &segment : vertical) {
+      std::sort(segment.crossings.begin(), segment.crossings.end(), [&](size_t c1, size_t c2) { return crossings[c1].rect.y() < crossings[c2].rect.y(); });
+    }
+  }
+
+  // Lowest index of a crossing the rect contacts, or -1
+  int findCrossing(const sRect &carRect, const sVec &direction, const std::vector<sCrossing> &crossings) const {
+    int found = -1;
+    forEachNear(carRect, direction, crossings, [&](size_t c) {
+      if ((found < 0 || static_cast<int>(c) < found) && carRect.contacts(crossings[c].rect))
+        found = static_cast<int>(c);
+    });
+    return found;
+  }
+
+  // Calls consider with every crossing a rect of a car going in the direction
+  // may contact, each once, and with few of the others
+  template <typename Consider>
+  void forEachNear(const sRect &rect, const sVec &direction, const std::vector<sCrossing> &crossings, Consider consider) const {
+    for (auto c : loose) {
+      consider(c);
+    }
+
+    if (direction.y == 0 && direction.x != 0) {
+      findAlong(horizontal, rect.p1.y, rect.p2.y, rect.p1.x, rect.p2.x, [&](size_t c) { return crossings[c].rect.x(); }, consider);
+    } else if (direction.x == 0 && direction.y != 0) {
+      findAlong(vertical, rect.p1.x, rect.p2.x, rect.p1.y, rect.p2.y, [&](size_t c) { return crossings[c].rect.y(); }, consider);
+    } else {
+      for (size_t c = 0; c < crossings.size(); ++c) {
+        consider(c);
+      }
+    }
+  }
+
+ private:
+  // Sorts by coord and joins the pieces a road is split into, so a lookup
+  // searches one list per line however many pieces lie on it
+  static void mergeCollinear(std::vector<sSegmentCrossings> &segments) {
+    std::sort(segments.begin(), segments.end(), [](const sSegmentCrossings &s1, const sSegmentCrossings &s2) { return s1.coord < s2.coord; });
+    size_t merged = 0;
+    for (size_t s = 0; s < segments.size(); ++s) {
+      if (merged > 0 && segments[merged - 1].coord == segments[s].coord) {
+        auto &into = segments[merged - 1].crossings;
+        into.insert(into.end(), segments[s].crossings.begin(), segments[s].crossings.end());
+      } else {
+        if (merged != s)
+          segments[merged] = std::move(segments[s]);
+        ++merged;
+      }
+    }
+    segments.resize(merged);
+  }
+
+  template <typename Position, typename Consider>
+  void findAlong(const std::vector<sSegmentCrossings> &segments, int across1, int across2, int along1, int along2, Position position, Consider consider) const {
+    auto it = std::lower_bound(segments.begin(), segments.end(), across1 - laneSize, [](const sSegmentCrossings &segment, int coord) { return segment.coord < coord; });
+    for (; it != segments.end() && it->coord <= across2 + laneSize; ++it) {
+      auto c = std::lower_bound(it->crossings.begin(), it->crossings.end(), along1 - maxCrossingSize, [&](size_t crossing, int coord) { return position(crossing) < coord; });
+      for (; c != it->crossings.end() && position(*c) <= along2; ++c) {
+        consider(*c);
+      }
+    }
+  }
+};
+
 typedef std::pair<sVec, eCarAlignment> sSpawn;
 
 struct sRoadData {
@@ -415,21 +922,28 @@ struct sRoadData {
   std::vector<sLineSegment> roadSegments;
   std::vector<sSpawn> spawns;
   std::vector<sCrossing> crossings;
-  std::vector<sCar *> cars;
-
-  sRoadData(int laneSize, std::vector<sLineSegment> roadSegments)  //
-      : laneSize(laneSize), roadSegments(roadSegments) {
-    sVec intersectionPoint;
-    for (auto it1 = roadSegments.begin(); it1 != (roadSegments.end() - 1); ++it1) {
-      for (auto it2 = it1 + 1; it2 != roadSegments.end(); ++it2) {
-        if (it1->intersects(*it2, &intersectionPoint)) {
-          crossings.emplace_back(sRect(                                               //
-          /**/ sVec(intersectionPoint.x - laneSize, intersectionPoint.y - laneSize),  //
-          /**/ sVec(intersectionPoint.x + laneSize, intersectionPoint.y + laneSize)   //
-          ));
-        }
-      }
+  std::vector<std::pair<size_t, size_t>> crossingSegments;  // the two road segments of each crossing
+  sCrossingIndex crossingIndex;
+  sCarStore cars;
+  sRandom random;
+
+  sRoadData(int laneSize, std::vector<sLineSegment> roadSegments, uint64_t seed = 0)  //
+      : laneSize(laneSize), roadSegments(roadSegments), random(seed) {
+    for (auto &crossing : findSegmentCrossings(roadSegments)) {
+      const sVec &intersectionPoint = crossing.point;
+      crossings.emplace_back(sRect(                                               //
+      /**/ sVec(intersectionPoint.x - laneSize, intersectionPoint.y - laneSize),  //
+      /**/ sVec(intersectionPoint.x + laneSize, intersectionPoint.y + laneSize)   //
+      ));
+      crossingSegments.emplace_back(crossing.first, crossing.second);
     }
+    crossingIndex.build(laneSize, this->roadSegments, crossings, crossingSegments);
+  }
+
+  // Road whose crossings are already known, such as one restored from a snapshot
+  sRoadData(int laneSize, std::vector<sLineSegment> roadSegments, std::vector<sCrossing> crossings, std::vector<std::pair<size_t, size_t>> crossingSegments)
+      : laneSize(laneSize), roadSegments(std::move(roadSegments)), crossings(std::move(crossings)), crossingSegments(std::move(crossingSegments)) {
+    crossingIndex.build(laneSize, this->roadSegments, this->crossings, this->crossingSegments);
   }
 
   void createSpawn(const sVec &position, eCarAlignment alignment, int carSizeSmall, int carSizeBig) {
@@ -466,30 +980,32 @@ struct sCarFactory {
   sCarFactory() = delete;
 
  public:
-  static sCar *createRandomCar(std::vector<sSpawn> &spawns, int w, int h) {
+  static sCar *createRandomCar(std::vector<sSpawn> &spawns, int w, int h, sRandom &random) {
     sCar *car = nullptr;
-    int type = rand() % 3;
+    int type = random.nextBelow(3);
     if (type == 0) {
       car = new sGasCar();
     } else if (type == 1) {
       car = new sElectroCar();
     } else {
-      car = new sHybridCar();
+      auto *hybridCar = new sHybridCar();
+      hybridCar->random = random.split();
+      car = hybridCar;
     }
 
     car->rect.setWidth(w);
     car->rect.setHeight(h);
-    setRandomPositionAndAlign(car, spawns);
+    setRandomPositionAndAlign(car, spawns, random);
     return car;
   }
 
-  static sCar *setRandomPositionAndAlign(sCar *car, std::vector<sSpawn> &spawns) {
-    std::pair<sVec, eCarAlignment> randomSpawn = spawns[std::rand() % spawns.size()];
+  static sCarState *setRandomPositionAndAlign(sCarState *car, std::vector<sSpawn> &spawns, sRandom &random) {
+    std::pair<sVec, eCarAlignment> randomSpawn = spawns[random.nextBelow(spawns.size())];
     placeAtSpawn(car, randomSpawn);
     return car;
   }
 
-  static sCar *placeAtSpawn(sCar *car, const sSpawn &spawn) {
+  static sCarState *placeAtSpawn(sCarState *car, const sSpawn &spawn) {
     car->setAlignment(spawn.second);
     car->rect.moveTo(spawn.first - car->direction * car->rect.size());
     return car;
@@ -502,6 +1018,8 @@ struct sDisplay {
   virtual void drawBackground() = 0;
   virtual void drawRoadData(const sRoadData &roadData) = 0;
   virtual void flush() = 0;
+  // False once the user closed the display
+  virtual bool isOpen() const { return true; }
 };
 
 #endif  // MYTONA_STRUCTS_HPP
@@ -0,0 +1,408 @@
+#ifndef MYTONA_TILES_HPP
+#define MYTONA_TILES_HPP
+
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include "structs.hpp"
+#include "spatial.hpp"
+#include "parallel.hpp"
+#include "simulator.hpp"
+
+// The road split into a grid of rectangular tiles for city-sized maps. A tile
+// owns the cars whose p1 lies in it and the crossings whose rect starts in it,
+// and runs the per-car passes of a tick for its own cars on a worker thread.
+// It looks other cars up in a grid of its own cars plus a halo: the cars of
+// neighbouring tiles close enough to meet its own cars' rects, forward rects
+// or crossings, mirrored in every tick. Cars migrate to the tile they moved
+// into at the start of a tick.
+//
+// Collision pushes go last car to first, respawns draw from the shared random
+// stream and deadlock checks depend on the order cars joined a crossing. For
+// those steps the tiles only find the few cars concerned, which are then
+// handled in index order on the calling thread, so a tiled tick leaves the
+// road exactly as simulateTick does, whatever the tile and thread counts.
+
+struct sTile {
+  // Bounds, open ended on the outer edges of the field so cars off it still have a tile
+  int64_t x1, y1, x2, y2;
+  std::vector<size_t> own;        // cars whose p1 lies in the tile, ascending
+  std::vector<size_t> crossings;  // crossings whose rect.p1 lies in the tile
+  std::vector<size_t> border;     // own cars that may be in a neighbour's halo
+  std::vector<size_t> local;      // own and halo cars, ascending
+  sCarGrid grid;                  // over the local cars
+
+  std::vector<size_t> found;    // cars a pass picked out for a serial step
+  std::vector<size_t> passing;  // cars moved out of turn to within the halo margin
+  std::vector<size_t> leaving, arriving, merged;
+  int maxCarSize = 0, maxSpeed = 0;
+};
+
+struct sTiledWorld {
+  int columns, rows;
+  int tileWidth, tileHeight;
+  std::vector<sTile> tiles;
+  std::vector<unsigned> tileOf;
+
+  // Runs the tiles when set; not owned
+  sThreadPool *pool = nullptr;
+
+  sTiledWorld(int fieldWidth, int fieldHeight, int columns, int rows)
+      : columns(columns), rows(rows), tileWidth(std::max(1, fieldWidth / columns)), tileHeight(std::max(1, fieldHeight / rows)), tiles(columns * rows) {
+    for (int ty = 0; ty < rows; ++ty) {
+      for (int tx = 0; tx < columns; ++tx) {
+        sTile &tile = tiles[ty * columns + tx];
+        tile.x1 = tx == 0 ? INT32_MIN : static_cast<int64_t>(tx) * tileWidth;
+        tile.x2 = tx == columns - 1 ? INT32_MAX : static_cast<int64_t>(tx + 1) * tileWidth;
+        tile.y1 = ty == 0 ? INT32_MIN : static_cast<int64_t>(ty) * tileHeight;
+        tile.y2 = ty == rows - 1 ? INT32_MAX : static_cast<int64_t>(ty + 1) * tileHeight;
+      }
+    }
+  }
+
+  unsigned tileAt(const sVec &position) const {
+    int tx = position.x >= 0 ? position.x / tileWidth : -1;
+    int ty = position.y >= 0 ? position.y / tileHeight : -1;
+    tx = std::min(std::max(tx, 0), columns - 1);
+    ty = std::min(std::max(ty, 0), rows - 1);
+    return static_cast<unsigned>(ty * columns + tx);
+  }
+
+  void tick(sRoadData &roadData, int scrWidth, int scrHeight) {
+    auto &cars = roadData.cars;
+    if (tileOf.size() != cars.size() || crossingsCount != roadData.crossings.size())
+      assign(roadData);
+    else
+      migrate(cars);
+    updateHalo(roadData, nullptr);
+
+    // resolveCollisions
+    forEachTile([&](sTile &tile) { findOverlapping(cars, tile); });
+    resolvePushes(cars);
+
+    // respawnOutOfFieldCars
+    sRect screenRect(scrWidth, scrHeight);
+    forEachTile([&](sTile &tile) {
+      tile.found.clear();
+      for (auto car : tile.own) {
+        bool inField = cars.rect(car).contacts(screenRect);
+        if (!cars.hasFlag(car, sCarStore::WAS_IN_FIELD)) {
+          if (inField)
+            cars.setFlag(car, sCarStore::WAS_IN_FIELD, true);
+        } else if (!inField) {
+          tile.found.push_back(car);
+        }
+      }
+    });
+    gatherFound();
+    for (auto car : gathered) {
+      respawnCar(roadData, car);
+      markMoved(cars, car);
+    }
+    if (!gathered.empty()) {
+      forEachTile([&](sTile &tile) { findOverlapping(cars, tile); });
+      resolvePushes(cars);
+    }
+    relocateMoved(cars);
+
+    // getVerboseCarsInfo
+    contacted.resize(cars.size());
+    forEachTile([&](sTile &tile) {
+      tile.found.clear();
+      for (auto car : tile.own) {
+        contacted[car] = roadData.crossingIndex.findCrossing(cars.rect(car), cars.directions[car], roadData.crossings);
+        if (contacted[car] != cars.crossings[car])
+          tile.found.push_back(car);
+      }
+    });
+    gatherFound();
+    for (auto car : gathered) {
+      setCarCrossing(car, contacted[car], roadData);
+    }
+    infos.resize(cars.size());
+    forEachTile([&](sTile &tile) {
+      for (auto car : tile.own) {
+        infos[car] = getCrossingCarInfo(car, roadData);
+      }
+    });
+
+    // getNextCarsPositionPairs, resolveDeadlocks and handleMovings
+    updateHalo(roadData, &infos);
+    moves.resize(cars.size());
+    forEachTile([&](sTile &tile) {
+      for (auto car : tile.own) {
+        moves[car] = getNextCarPositionPair(infos[car], infos, roadData, &tile.grid);
+      }
+    });
+    forEachTile([&](sTile &tile) {
+      for (auto crossing : tile.crossings) {
+        resolveDeadlock(roadData, roadData.crossings[crossing]);
+      }
+    });
+    forEachTile([&](sTile &tile) {
+      for (auto car : tile.own) {
+        cars.moveTo(car, moves[car].second);
+      }
+    });
+  }
+
+ private:
+  size_t crossingsCount = 0;
+  int margin = 0, rings = 1;
+
+  std::vector<sCrossingCarInfo> infos;
+  std::vector<sCarMove> moves;
+  std::vector<int> contacted;
+
+  // Serial steps: cars found by the tiles, cars moved out of turn, cars waiting for their collision turn
+  std::vector<size_t> gathered;
+  std::vector<size_t> moved;
+  std::vector<unsigned char> isMoved, isQueued;
+  std::vector<size_t> queue;
+
+  template <typename F>
+  void forEachTile(F fn) {
+    auto run = [&](size_t begin, size_t end) {
+      for (size_t t = begin; t < end; ++t) {
+        fn(tiles[t]);
+      }
+    };
+    if (pool == nullptr)
+      run(0, tiles.size());
+    else
+      pool->parallelFor(tiles.size(), 1, run);
+  }
+
+  void assign(const sRoadData &roadData) {
+    const sCarStore &cars = roadData.cars;
+    tileOf.resize(cars.size());
+    isMoved.assign(cars.size(), 0);
+    isQueued.assign(cars.size(), 0);
+    for (auto &tile : tiles) {
+      tile.own.clear();
+      tile.crossings.clear();
+    }
+    for (size_t car = 0; car < cars.size(); ++car) {
+      tileOf[car] = tileAt(cars.position(car));
+      tiles[tileOf[car]].own.push_back(car);
+    }
+    for (size_t c = 0; c < roadData.crossings.size(); ++c) {
+      tiles[tileAt(roadData.crossings[c].rect.p1)].crossings.push_back(c);
+    }
+    crossingsCount = roadData.crossings.size();
+  }
+
+  // Cars that moved into another tile go over to it, keeping every own list ascending
+  void migrate(const sCarStore &cars) {
+    forEachTile([&](sTile &tile) {
+      tile.leaving.clear();
+      size_t kept = 0;
+      for (auto car : tile.own) {
+        unsigned now = tileAt(cars.position(car));
+        if (now != tileOf[car]) {
+          tileOf[car] = now;
+          tile.leaving.push_back(car);
+        } else {
+          tile.own[kept++] = car;
+        }
+      }
+      tile.own.resize(kept);
+    });
+    for (auto &tile : tiles) {
+      for (auto car : tile.leaving) {
+        tiles[tileOf[car]].arriving.push_back(car);
+      }
+    }
+    forEachTile([&](sTile &tile) {
+      if (tile.arriving.empty())
+        return;
+      std::sort(tile.arriving.begin(), tile.arriving.end());
+      tile.merged.resize(tile.own.size() + tile.arriving.size());
+      std::merge(tile.own.begin(), tile.own.end(), tile.arriving.begin(), tile.arriving.end(), tile.merged.begin());
+      tile.own.swap(tile.merged);
+      tile.arriving.clear();
+    });
+  }
+
+  // Cars moved out of turn by pushes and respawns go straight to their new tile
+  void relocateMoved(const sCarStore &cars) {
+    for (auto car : moved) {
+      isMoved[car] = 0;
+      unsigned now = tileAt(cars.position(car));
+      if (now == tileOf[car])
+        continue;
+      auto &from = tiles[tileOf[car]].own, &to = tiles[now].own;
+      from.erase(std::lower_bound(from.begin(), from.end(), car));
+      to.insert(std::lower_bound(to.begin(), to.end(), car), car);
+      tileOf[car] = now;
+    }
+    moved.clear();
+    for (auto &tile : tiles) {
+      tile.passing.clear();
+    }
+  }
+
+  // Mirrors the cars of neighbouring tiles that own cars may meet and rebuilds
+  // the tile grids, grouping cars by crossing when infos are given
+  void updateHalo(const sRoadData &roadData, const std::vector<sCrossingCarInfo> *infos) {
+    const sCarStore &cars = roadData.cars;
+    forEachTile([&](sTile &tile) {
+      tile.maxCarSize = 0;
+      tile.maxSpeed = 0;
+      for (auto car : tile.own) {
+        tile.maxCarSize = std::max(tile.maxCarSize, std::max(cars.sizes[car].x, cars.sizes[car].y));
+        tile.maxSpeed = std::max(tile.maxSpeed, std::abs(cars.speeds[car]));
+      }
+    });
+
+    // reach of a car's rects and crossing past its p1, with room for the other car's size
+    int maxCarSize = 0, maxSpeed = 0, maxCrossingSize = 0;
+    for (auto &tile : tiles) {
+      maxCarSize = std::max(maxCarSize, tile.maxCarSize);
+      maxSpeed = std::max(maxSpeed, tile.maxSpeed);
+    }
+    for (auto &crossing : roadData.crossings) {
+      maxCrossingSize = std::max(maxCrossingSize, std::max(crossing.rect.width(), crossing.rect.height()));
+    }
+    margin = 3 * maxCarSize + maxSpeed + maxCrossingSize;
+    rings = (margin + std::min(tileWidth, tileHeight) - 1) / std::min(tileWidth, tileHeight);
+
+    forEachTile([&](sTile &tile) {
+      tile.border.clear();
+      for (auto car : tile.own) {
+        sVec p = cars.position(car);
+        if (p.x < tile.x1 + margin || p.x >= tile.x2 - margin || p.y < tile.y1 + margin || p.y >= tile.y2 - margin)
+          tile.border.push_back(car);
+      }
+    });
+
+    forEachTile([&](sTile &tile) {
+      int t = static_cast<int>(&tile - tiles.data());
+      int tx = t % columns, ty = t / columns;
+      tile.arriving.clear();
+      for (int ny = std::max(0, ty - rings); ny <= std::min(rows - 1, ty + rings); ++ny) {
+        for (int nx = std::max(0, tx - rings); nx <= std::min(columns - 1, tx + rings); ++nx) {
+          if (nx == tx && ny == ty)
+            continue;
+          for (auto car : tiles[ny * columns + nx].border) {
+            sVec p = cars.position(car);
+            if (p.x >= tile.x1 - margin && p.x < tile.x2 + margin && p.y >= tile.y1 - margin && p.y < tile.y2 + margin)
+              tile.arriving.push_back(car);
+          }
+        }
+      }
+      std::sort(tile.arriving.begin(), tile.arriving.end());
+      tile.local.resize(tile.own.size() + tile.arriving.size());
+      std::merge(tile.own.begin(), tile.own.end(), tile.arriving.begin(), tile.arriving.end(), tile.local.begin());
+      tile.arriving.clear();
+      tile.grid.rebuild(cars, tile.local, infos, roadData.crossings);
+    });
+  }
+
+  // Calls fn(car) for every car that may overlap the rect, cars moved out of turn included
+  template <typename F>
+  void forEachCandidate(const sRect &rect, F fn) const {
+    const sTile &tile = tiles[tileAt(rect.p1)];
+    tile.grid.forEachCandidate(rect, fn);
+    for (auto car : tile.passing) {
+      fn(car);
+    }
+  }
+
+  void findOverlapping(const sCarStore &cars, sTile &tile) const {
+    tile.found.clear();
+    for (auto car : tile.own) {
+      sRect rect = cars.rect(car);
+      bool overlapping = false;
+      forEachCandidate(rect, [&](size_t other) { overlapping = overlapping || (other != car && rect.overlaps(cars.rect(other))); });
+      if (overlapping)
+        tile.found.push_back(car);
+    }
+  }
+
+  void gatherFound() {
+    gathered.clear();
+    for (auto &tile : tiles) {
+      gathered.insert(gathered.end(), tile.found.begin(), tile.found.end());
+    }
+    std::sort(gathered.begin(), gathered.end());
+  }
+
+  // Lists a car moved out of turn with the tiles whose grids missed it at its new place
+  void markMoved(const sCarStore &cars, size_t car) {
+    if (!isMoved[car]) {
+      isMoved[car] = 1;
+      moved.push_back(car);
+    }
+    sVec p = cars.position(car);
+    unsigned t = tileAt(p);
+    int tx = static_cast<int>(t) % columns, ty = static_cast<int>(t) / columns;
+    for (int ny = std::max(0, ty - rings); ny <= std::min(rows - 1, ty + rings); ++ny) {
+      for (int nx = std::max(0, tx - rings); nx <= std::min(columns - 1, tx + rings); ++nx) {
+        sTile &tile = tiles[ny * columns + nx];
+        if (p.x >= tile.x1 - margin && p.x < tile.x2 + margin && p.y >= tile.y1 - margin && p.y < tile.y2 + margin)
+          tile.passing.push_back(car);
+      }
+    }
+  }
+
+  void enqueue(size_t car) {
+    if (!isQueued[car]) {
+      isQueued[car] = 1;
+      queue.push_back(car);
+      std::push_heap(queue.begin(), queue.end());
+    }
+  }
+
+  // resolveCollisions for the overlapping cars the tiles found. Cars are taken
+  // last to first as there; a car that isn't overlapping anything on its turn
+  // is left alone there, so only the found ones and those a push lands on
+  // later in the order need a turn.
+  void resolvePushes(sCarStore &cars) {
+    for (auto &tile : tiles) {
+      for (auto car : tile.found) {
+        enqueue(car);
+      }
+    }
+
+    while (!queue.empty()) {
+      std::pop_heap(queue.begin(), queue.end());
+      size_t i = queue.back();
+      queue.pop_back();
+      isQueued[i] = 0;
+
+      sRect carRect = cars.rect(i);
+      sVec pushBack = -cars.directions[i] * cars.sizes[i];
+      size_t nextOther = 0;
+      bool pushed = false;
+      while (true) {
+        size_t other = cars.size();
+        forEachCandidate(carRect, [&](size_t candidate) {
+          if (candidate != i && candidate >= nextOther && candidate < other && carRect.overlaps(cars.rect(candidate)))
+            other = candidate;
+        });
+        if (other == cars.size())
+          break;
+
+        sRect otherRect = cars.rect(other);
+        do {
+          carRect.moveBy(pushBack);
+        } while (carRect.overlaps(otherRect));
+        cars.moveTo(i, carRect.position());
+        pushed = true;
+        nextOther = other + 1;
+      }
+
+      if (pushed) {
+        markMoved(cars, i);
+        forEachCandidate(carRect, [&](size_t candidate) {
+          if (candidate < i && carRect.overlaps(cars.rect(candidate)))
+            enqueue(candidate);
+        });
+      }
+    }
+  }
+};
+
+#endif  // MYTONA_TILES_HPP
@@ -0,0 +1,464 @@
+#ifndef MYTONA_TRACE_HPP
+#define MYTONA_TRACE_HPP
+
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <tuple>
+#include <stdexcept>
+#include <algorithm>
+#include "structs.hpp"
+
+// Recorded run, replayable without the simulation. File layout:
+//   header   magic, version, road (lane size, segments, spawns), cars (kind, size)
+//   ticks    one record per tick; every keyframeInterval-th is a keyframe with
+//            absolute values, the rest are deltas against the tick before
+//   index    file offset of every keyframe
+//   trailer  index offset, ticks count, keyframe interval, magic (24 bytes)
+// Seeking reads the block from the tick's keyframe up to the next keyframe in
+// one go and decodes at most keyframeInterval - 1 deltas from there.
+// Variable fields are LEB128 varints, zigzagged when signed; the trailer and
+// index are fixed width little-endian.
+
+static constexpr uint32_t TRACE_MAGIC = 0x43525443;  // "CTRC"
+static constexpr uint32_t TRACE_VERSION = 1;
+static constexpr size_t TRACE_TRAILER_SIZE = 24;
+
+// Per-car record header bits; the low two hold the direction code
+enum eTraceCarBits : unsigned char {
+  TRACE_CHECK_SIDES = 1 << 2,
+  TRACE_STEPPED = 1 << 3,   // moved by its direction, no payload
+  TRACE_MOVED = 1 << 4,     // dx, dy follow
+  TRACE_CROSSING = 1 << 5,  // crossing + 1, slot + 1 follow
+};
+
+// The recorded part of a car's state
+struct sTraceCar {
+  int x = 0, y = 0;
+  unsigned char direction = 0;
+  bool checkSides = false;
+  int crossing = -1, crossingSlot = -1;
+};
+
+unsigned char traceDirectionCode(const sVec &direction) {
+  if (direction.x != 0)
+    return direction.x > 0 ? 0 : 1;
+  return direction.y < 0 ? 2 : 3;
+}
+
+sVec traceDirection(unsigned char code) {
+  static const sVec directions[4] = {sVec(1, 0), sVec(-1, 0), sVec(0, -1), sVec(0, 1)};
+  return directions[code & 3];
+}
+
+// 64-bit seeks; long is 32 bits on Windows
+int traceSeek(std::FILE *file, uint64_t offset, int origin) {
+#ifdef _WIN32
+  return _fseeki64(file, static_cast<int64_t>(offset), origin);
+#else
+  return fseeko(file, static_cast<off_t>(offset), origin);
+#endif
+}
+
+int64_t traceTell(std::FILE *file) {
+#ifdef _WIN32
+  return _ftelli64(file);
+#else
+  return ftello(file);
+#endif
+}
+
+void tracePutVarint(std::vector<unsigned char> &out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<unsigned char>(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<unsigned char>(value));
+}
+
+void tracePutSigned(std::vector<unsigned char> &out, int64_t value) { tracePutVarint(out, (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63)); }
+
+void tracePutFixed(std::vector<unsigned char> &out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+  }
+}
+
+// Bounds-checked reading over a block of the file
+struct sTraceCursor {
+  const unsigned char *at, *end;
+
+  unsigned char byte() {
+    if (at == end)
+      throw std::runtime_error("Truncated trace");
+    return *at++;
+  }
+
+  uint64_t varint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      unsigned char next = byte();
+      value |= static_cast<uint64_t>(next & 0x7f) << shift;
+      if ((next & 0x80) == 0)
+        return value;
+    }
+    throw std::runtime_error("Malformed varint in trace");
+  }
+
+  int64_t signedVarint() {
+    uint64_t value = varint();
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+  }
+
+  uint64_t fixed(int bytes) {
+    if (end - at < bytes)
+      throw std::runtime_error("Truncated trace");
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+      value |= static_cast<uint64_t>(*at++) << (8 * i);
+    }
+    return value;
+  }
+};
+
+struct sTraceWriter {
+  // The road and the car population are fixed for the whole trace
+  sTraceWriter(const std::string &path, const sRoadData &roadData, int keyframeInterval = 256) : keyframeInterval(keyframeInterval) {
+    if (keyframeInterval <= 0)
+      throw std::invalid_argument("Keyframe interval must be positive");
+    file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr)
+      throw std::runtime_error("Can't open " + path + " for writing");
+
+    tracePutFixed(buffer, TRACE_MAGIC, 4);
+    tracePutVarint(buffer, TRACE_VERSION);
+    tracePutSigned(buffer, roadData.laneSize);
+    tracePutVarint(buffer, roadData.roadSegments.size());
+    for (auto &segment : roadData.roadSegments) {
+      tracePutSigned(buffer, segment.p1.x);
+      tracePutSigned(buffer, segment.p1.y);
+      tracePutSigned(buffer, segment.p2.x);
+      tracePutSigned(buffer, segment.p2.y);
+    }
+    tracePutVarint(buffer, roadData.spawns.size());
+    for (auto &spawn : roadData.spawns) {
+      tracePutSigned(buffer, spawn.first.x);
+      tracePutSigned(buffer, spawn.first.y);
+      tracePutVarint(buffer, static_cast<uint64_t>(spawn.second));
+    }
+    tracePutVarint(buffer, roadData.crossings.size());
+
+    const sCarStore &cars = roadData.cars;
+    tracePutVarint(buffer, cars.size());
+    for (size_t i = 0; i < cars.size(); ++i) {
+      tracePutVarint(buffer, cars.kinds[i]);
+      tracePutVarint(buffer, std::max(cars.sizes[i].x, cars.sizes[i].y));
+      tracePutVarint(buffer, std::min(cars.sizes[i].x, cars.sizes[i].y));
+    }
+    previous.resize(cars.size());
+    flushBuffer();
+  }
+
+  // Errors can't be thrown from here; call close() to see them
+  ~sTraceWriter() {
+    try {
+      close();
+    } catch (...) {
+    }
+  }
+
+  sTraceWriter(const sTraceWriter &) = delete;
+  sTraceWriter &operator=(const sTraceWriter &) = delete;
+
+  // Appends the current state as the next tick
+  void record(const sRoadData &roadData) {
+    const sCarStore &cars = roadData.cars;
+    if (cars.size() != previous.size())
+      throw std::logic_error("Car count changed while tracing");
+
+    bool keyframe = ticksCount % keyframeInterval == 0;
+    if (keyframe)
+      keyframes.push_back(offset);
+
+    for (size_t i = 0; i < cars.size(); ++i) {
+      sTraceCar car;
+      car.x = cars.x[i];
+      car.y = cars.y[i];
+      car.direction = traceDirectionCode(cars.directions[i]);
+      car.checkSides = cars.hasFlag(i, sCarStore::CHECK_SIDES);
+      car.crossing = cars.crossings[i];
+      car.crossingSlot = cars.crossingSlots[i];
+
+      sTraceCar &last = previous[i];
+      unsigned char header = car.direction | (car.checkSides ? TRACE_CHECK_SIDES : 0);
+      if (keyframe) {
+        buffer.push_back(header);
+        tracePutSigned(buffer, car.x);
+        tracePutSigned(buffer, car.y);
+        tracePutVarint(buffer, car.crossing + 1);
+        tracePutVarint(buffer, car.crossingSlot + 1);
+      } else {
+        sVec delta(car.x - last.x, car.y - last.y);
+        bool crossingChanged = car.crossing != last.crossing || car.crossingSlot != last.crossingSlot;
+        if (delta == traceDirection(car.direction))
+          header |= TRACE_STEPPED;
+        else if (delta != sVec())
+          header |= TRACE_MOVED;
+        if (crossingChanged)
+          header |= TRACE_CROSSING;
+
+        buffer.push_back(header);
+        if (header & TRACE_MOVED) {
+          tracePutSigned(buffer, delta.x);
+          tracePutSigned(buffer, delta.y);
+        }
+        if (crossingChanged) {
+          tracePutVarint(buffer, car.crossing + 1);
+          tracePutVarint(buffer, car.crossingSlot + 1);
+        }
+      }
+      last = car;
+    }
+    ++ticksCount;
+    flushBuffer();
+  }
+
+  // Writes the index and trailer; the trace is unreadable until this ran
+  void close() {
+    if (file == nullptr)
+      return;
+    uint64_t indexOffset = offset;
+    for (uint64_t keyframeOffset : keyframes) {
+      tracePutFixed(buffer, keyframeOffset, 8);
+    }
+    tracePutFixed(buffer, indexOffset, 8);
+    tracePutFixed(buffer, ticksCount, 8);
+    tracePutFixed(buffer, keyframeInterval, 4);
+    tracePutFixed(buffer, TRACE_MAGIC, 4);
+    std::FILE *closing = file;
+    file = nullptr;
+    bool written = std::fwrite(buffer.data(), 1, buffer.size(), closing) == buffer.size();
+    buffer.clear();
+    if (std::fclose(closing) != 0 || !written)
+      throw std::runtime_error("Can't write trace");
+  }
+
+ private:
+  std::FILE *file = nullptr;
+  uint64_t offset = 0;
+  uint64_t ticksCount = 0;
+  int keyframeInterval;
+  std::vector<uint64_t> keyframes;
+  std::vector<sTraceCar> previous;
+  std::vector<unsigned char> buffer;
+
+  void flushBuffer() {
+    if (std::fwrite(buffer.data(), 1, buffer.size(), file) != buffer.size())
+      throw std::runtime_error("Can't write trace");
+    offset += buffer.size();
+    buffer.clear();
+  }
+};
+
+struct sTraceReader {
+  explicit sTraceReader(const std::string &path) {
+    file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr)
+      throw std::runtime_error("Can't open " + path);
+    try {
+      readIndexAndHeader(path);
+    } catch (...) {
+      std::fclose(file);
+      throw;
+    }
+  }
+
+  ~sTraceReader() { std::fclose(file); }
+
+  sTraceReader(const sTraceReader &) = delete;
+  sTraceReader &operator=(const sTraceReader &) = delete;
+
+  size_t ticksCount() const { return ticks; }
+
+  // The recorded road with the recorded cars in it; the cars are the caller's to delete
+  sRoadData createRoadData() const {
+    sRoadData roadData(laneSize, segments);
+    if (roadData.crossings.size() != crossingsCount)
+      throw std::runtime_error("Trace crossings don't match its road");
+    roadData.spawns = spawns;
+    for (size_t i = 0; i < kinds.size(); ++i) {
+      sCar *car = kinds[i] == CAR_KIND_ELECTRO ? static_cast<sCar *>(new sElectroCar()) : kinds[i] == CAR_KIND_HYBRID ? static_cast<sCar *>(new sHybridCar()) : new sGasCar();
+      car->rect = sRect(carSizes[i].x, carSizes[i].y);
+      roadData.cars.push_back(car);
+    }
+    return roadData;
+  }
+
+  // Loads the state of the tick into road data made by createRoadData
+  void seek(size_t tick, sRoadData &roadData) {
+    if (tick >= ticks)
+      throw std::out_of_range("Tick past the end of the trace");
+    size_t block = tick / keyframeInterval;
+    if (block != loadedBlock || tick < decodedTick) {
+      uint64_t begin = keyframes[block];
+      uint64_t end = block + 1 < keyframes.size() ? keyframes[block + 1] : indexOffset;
+      readAt(begin, end - begin);
+      loadedBlock = block;
+      blockCursor = cursor();
+      decodedTick = block * keyframeInterval;
+      decodeKeyframe();
+    }
+    while (decodedTick < tick) {
+      decodeDelta();
+      ++decodedTick;
+    }
+    apply(roadData);
+  }
+
+ private:
+  // Trailer, keyframe index and header; nothing in them is trusted
+  void readIndexAndHeader(const std::string &path) {
+    int64_t fileSize = traceSeek(file, 0, SEEK_END) == 0 ? traceTell(file) : -1;
+    if (fileSize < static_cast<int64_t>(TRACE_TRAILER_SIZE))
+      throw std::runtime_error("Not a trace: " + path);
+    uint64_t indexEnd = fileSize - TRACE_TRAILER_SIZE;
+    readAt(indexEnd, TRACE_TRAILER_SIZE);
+    sTraceCursor trailer = cursor();
+    indexOffset = trailer.fixed(8);
+    ticks = trailer.fixed(8);
+    keyframeInterval = trailer.fixed(4);
+    if (trailer.fixed(4) != TRACE_MAGIC || keyframeInterval == 0 || indexOffset > indexEnd)
+      throw std::runtime_error("Not a trace: " + path);
+
+    // the count is from the file, so it has to fit the index before anything is allocated for it
+    uint64_t keyframesCount = ticks / keyframeInterval + (ticks % keyframeInterval != 0);
+    if (keyframesCount > (indexEnd - indexOffset) / 8)
+      throw std::runtime_error("Truncated trace: " + path);
+    readAt(indexOffset, keyframesCount * 8);
+    sTraceCursor index = cursor();
+    for (size_t k = 0; k < keyframesCount; ++k) {
+      keyframes.push_back(index.fixed(8));
+      if (keyframes.back() > indexOffset || (k > 0 && keyframes[k] < keyframes[k - 1]))
+        throw std::runtime_error("Truncated trace: " + path);
+    }
+
+    readAt(0, keyframes.empty() ? indexOffset : keyframes.front());
+    sTraceCursor header = cursor();
+    if (header.fixed(4) != TRACE_MAGIC || header.varint() != TRACE_VERSION)
+      throw std::runtime_error("Unsupported trace version: " + path);
+    laneSize = header.signedVarint();
+    size_t segmentsCount = header.varint();
+    for (size_t s = 0; s < segmentsCount; ++s) {
+      int x1 = header.signedVarint(), y1 = header.signedVarint();
+      int x2 = header.signedVarint(), y2 = header.signedVarint();
+      segments.emplace_back(sVec(x1, y1), sVec(x2, y2));
+    }
+    size_t spawnsCount = header.varint();
+    for (size_t s = 0; s < spawnsCount; ++s) {
+      int x = header.signedVarint(), y = header.signedVarint();
+      spawns.emplace_back(sVec(x, y), static_cast<eCarAlignment>(header.varint()));
+    }
+    crossingsCount = header.varint();
+    size_t carsCount = header.varint();
+    for (size_t i = 0; i < carsCount; ++i) {
+      kinds.push_back(static_cast<eCarKind>(header.varint()));
+      int big = header.varint(), small = header.varint();
+      carSizes.emplace_back(big, small);
+    }
+    cars.resize(carsCount);
+  }
+
+  std::FILE *file = nullptr;
+  std::vector<unsigned char> data;
+  uint64_t indexOffset = 0;
+  uint64_t ticks = 0;
+  uint64_t keyframeInterval = 1;
+  std::vector<uint64_t> keyframes;
+
+  int laneSize = 0;
+  std::vector<sLineSegment> segments;
+  std::vector<sSpawn> spawns;
+  size_t crossingsCount = 0;
+  std::vector<eCarKind> kinds;
+  std::vector<sVec> carSizes;  // along and across the direction of travel
+
+  size_t loadedBlock = static_cast<size_t>(-1);
+  size_t decodedTick = 0;
+  sTraceCursor blockCursor{nullptr, nullptr};
+  std::vector<sTraceCar> cars;
+  std::vector<std::tuple<int, int, size_t>> crossingMembers;
+
+  void readAt(uint64_t offset, uint64_t size) {
+    data.resize(size);
+    if (traceSeek(file, offset, SEEK_SET) != 0 || std::fread(data.data(), 1, size, file) != size)
+      throw std::runtime_error("Truncated trace");
+  }
+
+  sTraceCursor cursor() const { return sTraceCursor{data.data(), data.data() + data.size()}; }
+
+  void decodeKeyframe() {
+    for (auto &car : cars) {
+      unsigned char header = blockCursor.byte();
+      car.direction = header & 3;
+      car.checkSides = (header & TRACE_CHECK_SIDES) != 0;
+      car.x = blockCursor.signedVarint();
+      car.y = blockCursor.signedVarint();
+      car.crossing = static_cast<int>(blockCursor.varint()) - 1;
+      car.crossingSlot = static_cast<int>(blockCursor.varint()) - 1;
+    }
+  }
+
+  void decodeDelta() {
+    for (auto &car : cars) {
+      unsigned char header = blockCursor.byte();
+      car.direction = header & 3;
+      car.checkSides = (header & TRACE_CHECK_SIDES) != 0;
+      if (header & TRACE_STEPPED) {
+        sVec step = traceDirection(car.direction);
+        car.x += step.x;
+        car.y += step.y;
+      } else if (header & TRACE_MOVED) {
+        car.x += blockCursor.signedVarint();
+        car.y += blockCursor.signedVarint();
+      }
+      if (header & TRACE_CROSSING) {
+        car.crossing = static_cast<int>(blockCursor.varint()) - 1;
+        car.crossingSlot = static_cast<int>(blockCursor.varint()) - 1;
+      }
+    }
+  }
+
+  void apply(sRoadData &roadData) {
+    sCarStore &store = roadData.cars;
+    crossingMembers.clear();
+    for (size_t i = 0; i < cars.size(); ++i) {
+      const sTraceCar &car = cars[i];
+      sVec direction = traceDirection(car.direction);
+      store.x[i] = car.x;
+      store.y[i] = car.y;
+      store.directions[i] = direction;
+      store.sizes[i] = direction.y == 0 ? carSizes[i] : sVec(carSizes[i].y, carSizes[i].x);
+      store.setFlag(i, sCarStore::CHECK_SIDES, car.checkSides);
+      store.crossings[i] = -1;
+      store.crossingSlots[i] = -1;
+      if (car.crossing >= static_cast<int>(roadData.crossings.size()))
+        throw std::runtime_error("Trace refers to a missing crossing");
+      if (car.crossing >= 0)
+        crossingMembers.emplace_back(car.crossing, car.crossingSlot, i);
+    }
+
+    // slots grow in entry order, which isDeadlocked relies on
+    std::sort(crossingMembers.begin(), crossingMembers.end());
+    for (auto &crossing : roadData.crossings) {
+      crossing.cars = sCrossingCars();
+    }
+    for (auto &member : crossingMembers) {
+      size_t car = std::get<2>(member);
+      store.crossings[car] = std::get<0>(member);
+      roadData.crossings[std::get<0>(member)].addCar(store, car);
+    }
+  }
+};
+
+#endif  // MYTONA_TRACE_HPP
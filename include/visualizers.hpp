@@ -1,43 +1,141 @@
 #ifndef MYTONA_VISUALIZERS_HPP
 #define MYTONA_VISUALIZERS_HPP
 
+#include <vector>
+#include <string>
 #include <stdexcept>
 #include <cstring>
+#include <cstdio>
 #include <iostream>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 #include "structs.hpp"
 #include "SDL2/SDL.h"
 
+// Rects of one colour, filled with a single renderer call
+struct sRectBatch {
+  SDL_Color color;
+  std::vector<SDL_Rect> rects;
+};
+
 class sSDL2Display : public sDisplay {
  private:
   int w, h;
   SDL_Window *wnd;
   SDL_Renderer *rnd;
+  // in the order their colours were first used since the last submit
+  std::vector<sRectBatch> batches;
+
+  // Background, roads, crossings and spawns, drawn once for the network below
+  SDL_Texture *staticLayer = nullptr;
+  bool staticLayerValid = false, renderTargetsFailed = false;
+  int staticLaneSize = 0;
+  std::vector<sLineSegment> staticSegments;
+  std::vector<sSpawn> staticSpawns;
 
   void destroySDL() {
+    // closing the window already tore everything down
+    if (wnd == nullptr)
+      return;
+    if (staticLayer != nullptr)
+      SDL_DestroyTexture(staticLayer);
+    staticLayer = nullptr;
     SDL_DestroyRenderer(rnd);
     SDL_DestroyWindow(wnd);
     rnd = nullptr;
     wnd = nullptr;
     SDL_Quit();
-
-#ifdef _WIN32
-    // Force kill process when SDL window is closed
-    exit(0);
-#endif
   }
 
-  void drawRect(const sRect &rect, int r, int g, int b) {
+  void drawRect(const sRect &rect, Uint8 r, Uint8 g, Uint8 b) {
     SDL_Rect rc;
     rc.x = rect.x();
-    rc.y = h - rect.y();
+    rc.y = h - rect.p2.y;
     rc.w = rect.width();
-    rc.h = -rect.height();
-    SDL_SetRenderDrawColor(rnd, r, g, b, SDL_ALPHA_OPAQUE);
-    if (SDL_RenderFillRect(rnd, &rc) != 0) {
-      throw std::runtime_error(SDL_GetError());
+    rc.h = rect.height();
+
+    size_t batch = 0;
+    while (batch < batches.size() && !(batches[batch].color.r == r && batches[batch].color.g == g && batches[batch].color.b == b)) {
+      ++batch;
+    }
+    if (batch == batches.size())
+      batches.push_back(sRectBatch{SDL_Color{r, g, b, SDL_ALPHA_OPAQUE}, {}});
+    batches[batch].rects.push_back(rc);
+  }
+
+  // Fills the rects drawn so far, a colour at a time. Colours are reused
+  // across layers, so each layer is submitted before the next is drawn.
+  void submitRects() {
+    for (auto &batch : batches) {
+      if (batch.rects.empty())
+        continue;
+      SDL_SetRenderDrawColor(rnd, batch.color.r, batch.color.g, batch.color.b, batch.color.a);
+      if (SDL_RenderFillRects(rnd, batch.rects.data(), static_cast<int>(batch.rects.size())) != 0) {
+        throw std::runtime_error(SDL_GetError());
+      }
+      batch.rects.clear();
     }
   }
 
+  // Everything but the cars and the deadlocked crossings, which change from frame to frame
+  void drawStaticLayer(const sRoadData &roadData) {
+    for (auto &roadSegment : roadData.roadSegments) {
+      auto x0 = std::min(roadSegment.p1.x, roadSegment.p2.x);
+      auto x1 = std::max(roadSegment.p1.x, roadSegment.p2.x);
+      auto y0 = std::min(roadSegment.p1.y, roadSegment.p2.y);
+      auto y1 = std::max(roadSegment.p1.y, roadSegment.p2.y);
+
+      if (y0 == y1) {
+        // horizontal
+        drawRect(sRect(x0, y0 - roadData.laneSize, x1 - x0, roadData.laneSize * 2), 51, 51, 51);
+        drawRect(sRect(x0, y0, x1 - x0, 1), 255, 255, 255);
+      }
+      if (x0 == x1) {
+        // vertical
+        drawRect(sRect(x0 - roadData.laneSize, y0, roadData.laneSize * 2, y1 - y0), 51, 51, 51);
+        drawRect(sRect(x0, y0, 1, y1 - y0), 255, 255, 255);
+      }
+    }
+    submitRects();
+
+    for (const auto &crossing : roadData.crossings) {
+      drawRect(crossing.rect, 40, 40, 40);
+    }
+
+    for (auto &spawn : roadData.spawns) {
+      drawRect(sRect(spawn.first, 1, 1), 255, 0, 0);
+    }
+    submitRects();
+  }
+
+  bool isStaticLayerOf(const sRoadData &roadData) const {
+    return staticLayerValid && staticLaneSize == roadData.laneSize && staticSegments == roadData.roadSegments && staticSpawns == roadData.spawns;
+  }
+
+  // Renders the static layer into its texture. Without render targets the
+  // layer stays invalid and is drawn every frame instead.
+  void updateStaticLayer(const sRoadData &roadData) {
+    if (renderTargetsFailed)
+      return;
+    if (staticLayer == nullptr)
+      staticLayer = SDL_CreateTexture(rnd, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_TARGET, w, h);
+    if (staticLayer == nullptr || SDL_SetRenderTarget(rnd, staticLayer) != 0) {
+      renderTargetsFailed = true;
+      return;
+    }
+
+    SDL_SetRenderDrawColor(rnd, 0, 150, 0, SDL_ALPHA_OPAQUE);
+    SDL_RenderClear(rnd);
+    drawStaticLayer(roadData);
+    SDL_SetRenderTarget(rnd, nullptr);
+
+    staticLayerValid = true;
+    staticLaneSize = roadData.laneSize;
+    staticSegments = roadData.roadSegments;
+    staticSpawns = roadData.spawns;
+  }
+
  public:
   sSDL2Display(int w, int h) : w(w), h(h) {
     if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -57,6 +155,8 @@ class sSDL2Display : public sDisplay {
 
   ~sSDL2Display() override { destroySDL(); }
 
+  bool isOpen() const override { return wnd != nullptr; }
+
   void drawBackground() override {
     if (wnd == nullptr || rnd == nullptr)
       return;
@@ -69,67 +169,60 @@ class sSDL2Display : public sDisplay {
     if (wnd == nullptr || rnd == nullptr)
       return;
 
-    for (auto &roadSegment : roadData.roadSegments) {
-      auto x0 = std::min(roadSegment.p1.x, roadSegment.p2.x);
-      auto x1 = std::max(roadSegment.p1.x, roadSegment.p2.x);
-      auto y0 = std::min(roadSegment.p1.y, roadSegment.p2.y);
-      auto y1 = std::max(roadSegment.p1.y, roadSegment.p2.y);
-
-      if (y0 == y1) {
-        // horizontal
-        drawRect(sRect(x0, y0 - roadData.laneSize, x1 - x0, roadData.laneSize * 2), 51, 51, 51);
-        drawRect(sRect(x0, y0, x1 - x0, 1), 255, 255, 255);
-      }
-      if (x0 == x1) {
-        // vertical
-        drawRect(sRect(x0 - roadData.laneSize, y0, roadData.laneSize * 2, y1 - y0), 51, 51, 51);
-        drawRect(sRect(x0, y0, 1, y1 - y0), 255, 255, 255);
-      }
-    }
+    if (!isStaticLayerOf(roadData))
+      updateStaticLayer(roadData);
+    if (staticLayerValid)
+      SDL_RenderCopy(rnd, staticLayer, nullptr, nullptr);
+    else
+      drawStaticLayer(roadData);
 
     for (const auto &crossing : roadData.crossings) {
-      if (crossing.isDeadlocked())
+      if (crossing.isDeadlocked(roadData.cars))
         drawRect(crossing.rect, 40, 40, 120);
-      else
-        drawRect(crossing.rect, 40, 40, 40);
     }
+    submitRects();
 
-    for (auto &spawn : roadData.spawns) {
-      drawRect(sRect(spawn.first, 1, 1), 255, 0, 0);
-    }
+    static const SDL_Color hoodColors[CAR_KIND_COUNT] = {
+        {0, 0, 255, SDL_ALPHA_OPAQUE},    // CAR_KIND_GAS
+        {0, 255, 0, SDL_ALPHA_OPAQUE},    // CAR_KIND_ELECTRO
+        {255, 255, 0, SDL_ALPHA_OPAQUE},  // CAR_KIND_HYBRID
+    };
 
-    for (const auto *car : roadData.cars) {
+    // bodies, then hoods over them, then front points over those
+    const sCarStore &cars = roadData.cars;
+    for (size_t i = 0; i < cars.size(); ++i) {
 #ifdef USE_DEBUGGEE_CAR
-      if (car->debuggee)
-        drawRect(car->rect, 255, 128, 128);
+      if (cars.hasFlag(i, sCarStore::DEBUGGEE))
+        drawRect(cars.rect(i), 255, 128, 128);
       else
 #endif
-      if (car->checkSides) {
-        int r, g, b;
-
-        if (dynamic_cast<sHybridCar *>(const_cast<sCar *>(car)) != nullptr) {
-          r = 255;
-          g = 255;
-          b = 0;
-        } else if (dynamic_cast<sGasCar *>(const_cast<sCar *>(car)) != nullptr) {
-          r = 0;
-          g = 0;
-          b = 255;
-        } else {
-          r = 0;
-          g = 255;
-          b = 0;
-        }
-
-        sRect carHoodRect(car->frontPoint() + car->rect.size() / 2 * car->direction.rightPerpendicular() - car->rect.size() / 4 * car->direction,
-                          car->frontPoint() + car->rect.size() / 2 * car->direction.leftPerpendicular());
-        drawRect(car->rect, 0,0,0);
-        drawRect(carHoodRect, r, g, b);
-      } else {
-        drawRect(car->rect, 255, 0, 0);
-      }
-      drawRect(sRect(car->frontPoint(), 1, 1), 0, 255, 0);
+      if (cars.hasFlag(i, sCarStore::CHECK_SIDES))
+        drawRect(cars.rect(i), 0, 0, 0);
+      else
+        drawRect(cars.rect(i), 255, 0, 0);
     }
+    submitRects();
+
+    for (size_t i = 0; i < cars.size(); ++i) {
+#ifdef USE_DEBUGGEE_CAR
+      if (cars.hasFlag(i, sCarStore::DEBUGGEE))
+        continue;
+#endif
+      if (!cars.hasFlag(i, sCarStore::CHECK_SIDES))
+        continue;
+      const sCarState car = cars.state(i);
+      const SDL_Color &hoodColor = hoodColors[cars.kinds[i]];
+
+      sRect carHoodRect(car.frontPoint() + car.rect.size() / 2 * car.direction.rightPerpendicular() - car.rect.size() / 4 * car.direction,
+                        car.frontPoint() + car.rect.size() / 2 * car.direction.leftPerpendicular());
+      drawRect(carHoodRect, hoodColor.r, hoodColor.g, hoodColor.b);
+    }
+    submitRects();
+
+    for (size_t i = 0; i < cars.size(); ++i) {
+      drawRect(sRect(cars.frontPoint(i), 1, 1), 0, 255, 0);
+    }
+    submitRects();
   }
 
   void flush() override {
@@ -141,52 +234,70 @@ class sSDL2Display : public sDisplay {
         destroySDL();
         break;
       }
+      // some renderers lose texture contents with the device
+      if (e.type == SDL_RENDER_TARGETS_RESET || e.type == SDL_RENDER_DEVICE_RESET)
+        staticLayerValid = false;
     }
   }
 };
 
+// Draws into a row-major character buffer, one cell per scale x scale block
+// of the field, and redraws only the cells that changed since the last
+// flush, as ANSI cursor moves and characters gathered into one write to the
+// terminal
 class sTerminalDisplay : public sDisplay {
  private:
-  char *buffer;
   int w, h;
+  int scale;
+  int columns, rows;
+  std::vector<char> buffer;  // cells row by row from the bottom of the field
+  std::vector<char> shown;   // what the terminal shows, row by row from the top
+  std::string output;
 
   static constexpr char spaceChar = ' ';
   static constexpr char roadChar = '.';
   static constexpr char crossingChar = ':';
+  // unchanged cells shorter than a cursor move are rewritten instead
+  static constexpr int maxRewrittenGap = 6;
 
-  void setChar(int x, int y, char c) {
-    if (x >= 0 && x < w && y >= 0 && y < h)
-      buffer[x * h + y] = c;
-  }
-
-  char getChar(int x, int y) const {
-    if (x >= 0 && x < w && y >= 0 && y < h)
-      return buffer[x * h + y];
-    return '\0';
-  }
-
+  // Fills every cell the rect touches, clipped to the field
   void drawRect(const sRect &rect, char c) {
-    for (size_t y = rect.p1.y; y < rect.p2.y; ++y) {
-      for (size_t x = rect.p1.x; x < rect.p2.x; ++x) {
-        setChar(x, y, c);
-      }
+    int x1 = std::max(rect.p1.x, 0), x2 = std::min(rect.p2.x, w);
+    int y1 = std::max(rect.p1.y, 0), y2 = std::min(rect.p2.y, h);
+    if (x1 >= x2 || y1 >= y2)
+      return;
+    int column1 = x1 / scale, column2 = (x2 + scale - 1) / scale;
+    int row1 = y1 / scale, row2 = (y2 + scale - 1) / scale;
+    for (int row = row1; row < row2; ++row) {
+      std::memset(&buffer[row * columns + column1], c, column2 - column1);
     }
   }
 
-  void drawRect(sRect &&rect, char c) {
-    for (size_t y = rect.p1.y; y < rect.p2.y; ++y) {
-      for (size_t x = rect.p1.x; x < rect.p2.x; ++x) {
-        setChar(x, y, c);
-      }
+  void moveCursor(int row, int column) {
+    char move[32];
+    int length = std::snprintf(move, sizeof(move), "\x1b[%d;%dH", row + 1, column + 1);
+    output.append(move, length);
+  }
+
+  static void writeOut(const std::string &data) {
+#ifdef _WIN32
+    std::fwrite(data.data(), 1, data.size(), stdout);
+    std::fflush(stdout);
+#else
+    for (size_t written = 0; written < data.size();) {
+      ssize_t result = write(STDOUT_FILENO, data.data() + written, data.size() - written);
+      if (result <= 0)
+        return;
+      written += static_cast<size_t>(result);
     }
+#endif
   }
 
  public:
-  sTerminalDisplay(int w, int h) : w(w), h(h) { buffer = new char[w * h]; }
+  sTerminalDisplay(int w, int h, int scale = 1)
+      : w(w), h(h), scale(std::max(scale, 1)), columns((w + this->scale - 1) / this->scale), rows((h + this->scale - 1) / this->scale), buffer(columns * rows) {}
 
-  ~sTerminalDisplay() override { delete[] buffer; }
-
-  void drawBackground() override { std::memset(buffer, spaceChar, w * h); }
+  void drawBackground() override { std::memset(buffer.data(), spaceChar, buffer.size()); }
 
   void drawRoadData(const sRoadData &roadData) override {
     for (auto &roadSegment : roadData.roadSegments) {
@@ -213,24 +324,48 @@ class sTerminalDisplay : public sDisplay {
       drawRect(sRect(spawn.first, 1, 1), '#');
     }
 
-    int i = 0;
-    for (const auto *car : roadData.cars) {
-      drawRect(car->rect, '0' + (i++));
+    for (size_t i = 0; i < roadData.cars.size(); ++i) {
+      // one printable character per car, or the diff's columns go off
+      drawRect(roadData.cars.rect(i), i <= 9 ? static_cast<char>('0' + i) : '+');
     }
   }
 
-  void flush() override {
-#if defined(_WIN32)
-    system("cls");
-#else
-    system("clear");
-#endif
-    for (int y = h - 1; y >= 0; --y) {
-      for (int x = 0; x < w; ++x) {
-        std::cout << getChar(x, y);
+  // ANSI output taking the terminal from the last frame to the drawn one,
+  // which then counts as shown. The first frame clears the screen.
+  const std::string &diffFrame() {
+    output.clear();
+    if (shown.empty()) {
+      // clear and compare against blank cells
+      output += "\x1b[2J";
+      shown.assign(buffer.size(), char{spaceChar});
+    }
+
+    for (int row = 0; row < rows; ++row) {
+      const char *drawnRow = &buffer[(rows - 1 - row) * columns];
+      char *shownRow = &shown[row * columns];
+      if (std::memcmp(drawnRow, shownRow, columns) == 0)
+        continue;
+      int cursor = -1;  // column the cursor is at in this row after the last write, if any
+      for (int x = 0; x < columns; ++x) {
+        char c = drawnRow[x];
+        if (c == shownRow[x])
+          continue;
+        if (cursor >= 0 && x > cursor && x - cursor <= maxRewrittenGap)
+          output.append(shownRow + cursor, x - cursor);
+        else if (cursor != x)
+          moveCursor(row, x);
+        output += c;
+        shownRow[x] = c;
+        cursor = x + 1;
       }
-      std::cout << std::endl;
     }
+    return output;
+  }
+
+  void flush() override {
+    diffFrame();
+    if (!output.empty())
+      writeOut(output);
   }
 };
 
@@ -3,86 +3,111 @@
 #include <iostream>
 #include <thread>
 #include <chrono>
+#include <ctime>
+#include <atomic>
 #ifdef _WIN32
 #include <windows.h>
 #endif
 #include "structs.hpp"
 #include "simulator.hpp"
 #include "visualizers.hpp"
+#include "scenario.hpp"
+#include "parallel.hpp"
 
-static constexpr int SCREEN_WIDTH = 640;
-static constexpr int SCREEN_HEIGHT = 480;
-static constexpr int CARS_COUNT = 20;
-static constexpr int ROAD_WIDTH = 40;
-static constexpr int CAR_SIZE_SMALL = 20;
-static constexpr int CAR_SIZE_BIG = 40;
 static constexpr int DELAY_BETWEEN_FRAMES_MS = 10;
 
+// Usage: out [--scenario <file> | --grid <columns>x<rows>]
+
+// What the display draws of a tick besides the road network
+struct sRoadSnapshot {
+  sCarStore cars;
+  std::vector<sCrossing> crossings;
+};
+
+static void sleepBetweenFrames() {
+#ifndef _WIN32
+  std::this_thread::sleep_for(std::chrono::milliseconds(DELAY_BETWEEN_FRAMES_MS));
+#else
+  Sleep(DELAY_BETWEEN_FRAMES_MS);
+#endif
+}
+
 #ifdef _WIN32
 int WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 #else
 int main(int argc, char **argv)
 #endif
 {
-  // auto *display = new sTerminalDisplay(SCREEN_WIDTH, SCREEN_HEIGHT);
-  auto *display = new sSDL2Display(SCREEN_WIDTH, SCREEN_HEIGHT);
+#ifdef _WIN32
+  int argc = __argc;
+  char **argv = __argv;
+#endif
+  const char *scenarioPath = nullptr, *gridSize = nullptr;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (std::strcmp(argv[i], "--scenario") == 0)
+      scenarioPath = argv[i + 1];
+    else if (std::strcmp(argv[i], "--grid") == 0)
+      gridSize = argv[i + 1];
+  }
 
-  std::srand(std::time(0));
-  sVec roadSegment1_p1 = sVec(0, SCREEN_HEIGHT / 2);
-  sVec roadSegment1_p2 = sVec(SCREEN_WIDTH, SCREEN_HEIGHT / 2);
-  sVec roadSegment2_p1 = sVec(SCREEN_WIDTH / 3, SCREEN_HEIGHT);
-  sVec roadSegment2_p2 = sVec(SCREEN_WIDTH / 3, 0);
-  // sVec roadSegment3_p1 = sVec(2 * SCREEN_WIDTH / 3, SCREEN_HEIGHT);
-  // sVec roadSegment3_p2 = sVec(2 * SCREEN_WIDTH / 3, 0);
+  uint64_t seed = std::time(0);
+  std::cout << "Seed: " << seed << std::endl;
+  int fieldWidth, fieldHeight;
+  sRoadData roadData = createRoadDataFromOptions(scenarioPath, gridSize, seed, fieldWidth, fieldHeight);
+  spawnCars(roadData, CARS_COUNT);
 
-  sRoadData roadData(ROAD_WIDTH, {
-                                 sLineSegment(roadSegment1_p1, roadSegment1_p2),  //
-                                 sLineSegment(roadSegment2_p1, roadSegment2_p2),  //
-                                 //  sLineSegment(roadSegment3_p1, roadSegment3_p2)   // FIXME: Deadlock checking doesn't work as expected
-                                 });
+  // auto *display = new sTerminalDisplay(fieldWidth, fieldHeight);
+  auto *display = new sSDL2Display(fieldWidth, fieldHeight);
 
-  roadData.createSpawn(roadSegment1_p1, eCarAlignment::CAR_MOVE_EAST, CAR_SIZE_SMALL, CAR_SIZE_BIG);
-  roadData.createSpawn(roadSegment1_p2, eCarAlignment::CAR_MOVE_WEST, CAR_SIZE_SMALL, CAR_SIZE_BIG);
-  roadData.createSpawn(roadSegment2_p1, eCarAlignment::CAR_MOVE_SOUTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
-  roadData.createSpawn(roadSegment2_p2, eCarAlignment::CAR_MOVE_NORTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
-  // roadData.createSpawn(roadSegment3_p1, eCarAlignment::CAR_MOVE_SOUTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
-  // roadData.createSpawn(roadSegment3_p2, eCarAlignment::CAR_MOVE_NORTH, CAR_SIZE_SMALL, CAR_SIZE_BIG);
+  // The simulation ticks on its own thread and publishes a snapshot after
+  // each tick; the display draws the latest one, so neither waits for the other
+  sTripleBuffer<sRoadSnapshot> snapshots;
+  std::atomic<bool> isRunning{true};
+  // the network to draw, with the cars and crossings of the latest snapshot swapped in
+  sRoadData view = roadData;
 
-  for (int i = 0; i < CARS_COUNT; ++i) {
-    auto *car = sCarFactory::createRandomCar(roadData.spawns, CAR_SIZE_BIG, CAR_SIZE_SMALL);
-    car->speed = 1;
-#ifdef USE_DEBUGGEE_CAR
-    if (i == 5)
-      car->debuggee = true;
+  std::thread simulation([&] {
+    sSimulationFrame frame;
+#ifdef SIM_PROFILE
+    sProfiler profiler;
+    frame.profiler = &profiler;
 #endif
-    roadData.cars.push_back(car);
-  }
+    while (isRunning) {
+      simulateTick(roadData, frame, fieldWidth, fieldHeight);
+      sRoadSnapshot &snapshot = snapshots.back();
+      snapshot.cars = roadData.cars;
+      snapshot.crossings = roadData.crossings;
+      snapshots.publish();
+      PROFILE_END_FRAME(profiler);
+      sleepBetweenFrames();
+    }
+    PROFILE_REPORT(profiler);
+  });
 
-  bool isRunning = true;
-
-  while (isRunning) {
+#ifdef SIM_PROFILE
+  sProfiler displayProfiler;
+#endif
+  while (display->isOpen()) {
+    if (snapshots.acquire()) {
+      std::swap(view.cars, snapshots.front().cars);
+      std::swap(view.crossings, snapshots.front().crossings);
+    }
     display->drawBackground();
-    resolveCollisions(roadData);
-    respawnOutOfFieldCars(roadData, SCREEN_WIDTH, SCREEN_HEIGHT);
-    auto verboseCarsInfo = getVerboseCarsInfo(roadData);
-    auto moveData = getNextCarsPositionPairs(roadData, verboseCarsInfo);
-    resolveDeadlocks(roadData);
-    handleMovings(moveData);
-    display->drawRoadData(roadData);
+    {
+      PROFILE_SCOPE(&displayProfiler, PROFILE_DRAW_ROAD_DATA);
+      display->drawRoadData(view);
+    }
     display->flush();
-#ifndef _WIN32
-    std::this_thread::sleep_for(std::chrono::milliseconds(DELAY_BETWEEN_FRAMES_MS));
-#else
-    Sleep(DELAY_BETWEEN_FRAMES_MS);
-#endif
+    PROFILE_END_FRAME(displayProfiler);
+    sleepBetweenFrames();
   }
 
+  isRunning = false;
+  simulation.join();
+  PROFILE_REPORT(displayProfiler);
   delete display;
   display = nullptr;
-  for (int i = 0; i < CARS_COUNT; ++i) {
-    delete roadData.cars[i];
-    roadData.cars[i] = nullptr;
-  }
+  destroyCars(roadData);
 
   return 0;
 }
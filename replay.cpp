@@ -0,0 +1,69 @@
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+#include "structs.hpp"
+#include "visualizers.hpp"
+#include "scenario.hpp"
+#include "trace.hpp"
+
+// Plays a trace recorded by headless back on a display, without simulating.
+// Usage: replay <trace file> [first tick] [--terminal]
+
+static constexpr int DELAY_BETWEEN_FRAMES_MS = 10;
+// the terminal shows the field downscaled to at most this many columns
+static constexpr int TERMINAL_COLUMNS = 160;
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " <trace file> [first tick] [--terminal]" << std::endl;
+    return 1;
+  }
+
+  bool useTerminal = std::strcmp(argv[argc - 1], "--terminal") == 0;
+  int positionalCount = useTerminal ? argc - 1 : argc;
+  size_t firstTick = positionalCount == 3 ? std::strtoull(argv[2], nullptr, 10) : 0;
+
+  sTraceReader trace(argv[1]);
+  if (firstTick >= trace.ticksCount()) {
+    std::cerr << "The trace has " << trace.ticksCount() << " ticks" << std::endl;
+    return 1;
+  }
+  sRoadData roadData = trace.createRoadData();
+
+  // the field isn't recorded, but roads run across it
+  int fieldWidth = 1, fieldHeight = 1;
+  for (auto &segment : roadData.roadSegments) {
+    fieldWidth = std::max(fieldWidth, std::max(segment.p1.x, segment.p2.x));
+    fieldHeight = std::max(fieldHeight, std::max(segment.p1.y, segment.p2.y));
+  }
+
+  sDisplay *display = nullptr;
+  if (useTerminal)
+    display = new sTerminalDisplay(fieldWidth, fieldHeight, (fieldWidth + TERMINAL_COLUMNS - 1) / TERMINAL_COLUMNS);
+  else
+    display = new sSDL2Display(fieldWidth, fieldHeight);
+
+  for (size_t tick = firstTick; tick < trace.ticksCount() && display->isOpen(); ++tick) {
+    trace.seek(tick, roadData);
+    display->drawBackground();
+    display->drawRoadData(roadData);
+    display->flush();
+#ifndef _WIN32
+    std::this_thread::sleep_for(std::chrono::milliseconds(DELAY_BETWEEN_FRAMES_MS));
+#else
+    Sleep(DELAY_BETWEEN_FRAMES_MS);
+#endif
+  }
+
+  delete display;
+  display = nullptr;
+  destroyCars(roadData);
+
+  return 0;
+}
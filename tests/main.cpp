@@ -1,6 +1,44 @@
 #include <vector>
+#include <new>
+#include <cstdlib>
+#include <fstream>
 #include <gtest/gtest.h>
 #include "structs.hpp"
+#include "simulator.hpp"
+#include "scenario.hpp"
+#include "trace.hpp"
+#include "snapshot.hpp"
+#include "events.hpp"
+#include "tiles.hpp"
+#include "distributed.hpp"
+#include "visualizers.hpp"
+
+static size_t allocationsCount = 0;
+
+// Every replaceable form goes through these two, kept out of line so the
+// compiler doesn't pair an inlined free with the new expression it sees
+#if defined(__GNUC__)
+#define TEST_NOINLINE __attribute__((noinline))
+#else
+#define TEST_NOINLINE
+#endif
+
+TEST_NOINLINE static void *countedAllocate(size_t size)
+{
+    ++allocationsCount;
+    if (void *memory = std::malloc(size))
+        return memory;
+    throw std::bad_alloc();
+}
+
+TEST_NOINLINE static void countedFree(void *memory) noexcept { std::free(memory); }
+
+void *operator new(size_t size) { return countedAllocate(size); }
+void *operator new[](size_t size) { return countedAllocate(size); }
+void operator delete(void *memory) noexcept { countedFree(memory); }
+void operator delete[](void *memory) noexcept { countedFree(memory); }
+void operator delete(void *memory, size_t) noexcept { countedFree(memory); }
+void operator delete[](void *memory, size_t) noexcept { countedFree(memory); }
 
 TEST(Rect, RectIntersections)
 {
@@ -27,4 +65,623 @@ TEST(Rect, RectIntersections)
     sRect r11(10, 8, 2, 4);
     ASSERT_TRUE(r10.touches(r11));
     ASSERT_FALSE(r10.overlaps(r11));
-}
\ No newline at end of file
+
+    sRect r12(0, 0, 2, 2);
+    sRect r13(2, 10, 2, 2);
+    ASSERT_FALSE(r12.touches(r13));
+}
+TEST(Simulator, ResolveCollisionsMatchesPairwiseScan)
+{
+    sRoadData roadData = createDefaultRoadData(7);
+    spawnCars(roadData, 300);
+
+    std::vector<sRect> expected;
+    for (size_t i = 0; i < roadData.cars.size(); ++i) {
+        expected.push_back(roadData.cars.rect(i));
+    }
+    for (size_t i = expected.size(); i-- > 0;) {
+        for (size_t j = 0; j < expected.size(); ++j) {
+            if (i == j)
+                continue;
+            while (expected[i].overlaps(expected[j])) {
+                expected[i].moveBy(-roadData.cars.directions[i] * expected[i].size());
+            }
+        }
+    }
+
+    resolveCollisions(roadData);
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQ(roadData.cars.position(i), expected[i].p1);
+    }
+    destroyCars(roadData);
+}
+
+TEST(Car, KindMatchesConcreteType)
+{
+    sGasCar gasCar;
+    sElectroCar electroCar;
+    sHybridCar hybridCar;
+    ASSERT_EQ(gasCar.kind, CAR_KIND_GAS);
+    ASSERT_EQ(electroCar.kind, CAR_KIND_ELECTRO);
+    ASSERT_EQ(hybridCar.kind, CAR_KIND_HYBRID);
+}
+
+TEST(Crossing, IndexMatchesLinearScan)
+{
+    std::vector<sLineSegment> segments;
+    for (int i = 1; i <= 4; ++i) {
+        // rows come in two pieces, which the index keeps as one line
+        segments.emplace_back(sVec(0, i * 150), sVec(375, i * 150));
+        segments.emplace_back(sVec(375, i * 150), sVec(750, i * 150));
+        segments.emplace_back(sVec(i * 150, 0), sVec(i * 150, 750));
+    }
+    sRoadData roadData(40, segments);
+    ASSERT_EQ(roadData.crossings.size(), 16u);
+    ASSERT_EQ(roadData.crossingIndex.horizontal.size(), 4u);
+
+    sRandom random(11);
+    const sVec directions[] = {sVec(1, 0), sVec(-1, 0), sVec(0, 1), sVec(0, -1)};
+    for (int i = 0; i < 20000; ++i) {
+        sVec direction = directions[random.nextBelow(4)];
+        sRect carRect(random.nextBelow(800) - 25, random.nextBelow(800) - 25, direction.x != 0 ? 40 : 20, direction.x != 0 ? 20 : 40);
+
+        int expected = -1;
+        for (size_t c = 0; c < roadData.crossings.size() && expected < 0; ++c) {
+            if (carRect.contacts(roadData.crossings[c].rect))
+                expected = c;
+        }
+        ASSERT_EQ(roadData.crossingIndex.findCrossing(carRect, direction, roadData.crossings), expected);
+    }
+}
+
+TEST(Crossing, CarsPastCapacityKeepTheirOrder)
+{
+    sRoadData roadData = createDefaultRoadData(2);
+    spawnCars(roadData, 3 * sCrossingCars::CAPACITY);
+    sCrossing &crossing = roadData.crossings[0];
+    std::vector<size_t> expected;
+    for (size_t i = 0; i < roadData.cars.size(); ++i) {
+        crossing.addCar(roadData.cars, i);
+        expected.push_back(i);
+        // leave holes behind so the full tail is squeezed as well as grown
+        if (i % 3 == 0) {
+            crossing.removeCar(roadData.cars, i);
+            expected.pop_back();
+        }
+    }
+    ASSERT_EQ(crossing.cars.size(), expected.size());
+    std::vector<size_t> registered;
+    for (auto car : crossing.cars) {
+        registered.push_back(car);
+    }
+    ASSERT_EQ(registered, expected);
+    for (size_t i : expected) {
+        crossing.removeCar(roadData.cars, i);
+    }
+    ASSERT_TRUE(crossing.cars.empty());
+    destroyCars(roadData);
+}
+
+TEST(Crossing, SweepFindsOnlySegmentIntersections)
+{
+    // lines of these two cross, the segments don't
+    ASSERT_TRUE(findSegmentCrossings({sLineSegment(sVec(0, 0), sVec(100, 0)), sLineSegment(sVec(200, -50), sVec(200, 50))}).empty());
+
+    sRandom random(3);
+    std::vector<sLineSegment> segments;
+    for (int i = 0; i < 300; ++i) {
+        sVec p1(random.nextBelow(1000), random.nextBelow(1000));
+        sVec p2 = p1;
+        int kind = random.nextBelow(7);
+        if (kind < 3)
+            p2.x = random.nextBelow(1000);
+        else if (kind < 6)
+            p2.y = random.nextBelow(1000);
+        else
+            p2 = sVec(random.nextBelow(1000), random.nextBelow(1000));
+        segments.emplace_back(p1, p2);
+    }
+
+    std::vector<sSegmentCrossing> expected;
+    std::vector<sVec> points;
+    sVec point;
+    for (size_t i = 0; i < segments.size(); ++i) {
+        for (size_t j = i + 1; j < segments.size(); ++j) {
+            if (!segments[i].meets(segments[j]) || !segments[i].intersects(segments[j], &point))
+                continue;
+            // intersects rounds in float, the sweep is exact for a row and a column
+            if (segments[i].isHorizontal() && segments[j].isVertical())
+                point = sVec(segments[j].p1.x, segments[i].p1.y);
+            if (segments[i].isVertical() && segments[j].isHorizontal())
+                point = sVec(segments[i].p1.x, segments[j].p1.y);
+            // the first pair crossing at a point stands for it
+            if (std::find(points.begin(), points.end(), point) != points.end())
+                continue;
+            points.push_back(point);
+            expected.push_back(sSegmentCrossing{i, j, point});
+        }
+    }
+
+    std::vector<sSegmentCrossing> found = findSegmentCrossings(segments);
+    ASSERT_EQ(found.size(), expected.size());
+    for (size_t c = 0; c < found.size(); ++c) {
+        ASSERT_EQ(found[c].first, expected[c].first);
+        ASSERT_EQ(found[c].second, expected[c].second);
+        ASSERT_EQ(found[c].point, expected[c].point);
+    }
+
+    // a grid of roads split into block-long pieces has one crossing per node
+    const int columns = 6, rows = 5, block = 100;
+    std::vector<sLineSegment> pieces;
+    for (int row = 1; row <= rows; ++row) {
+        for (int x = 0; x <= columns * block; x += block) {
+            pieces.emplace_back(sVec(x, row * block), sVec(x + block, row * block));
+        }
+    }
+    for (int column = 1; column <= columns; ++column) {
+        for (int y = 0; y <= rows * block; y += block) {
+            pieces.emplace_back(sVec(column * block, y), sVec(column * block, y + block));
+        }
+    }
+    sRoadData roadData(40, pieces);
+    ASSERT_EQ(roadData.crossings.size(), static_cast<size_t>(columns * rows));
+}
+
+TEST(Simulator, SteadyStateTickDoesNotAllocate)
+{
+    sRoadData roadData = createDefaultRoadData(5);
+    spawnCars(roadData, 200);
+    sSimulationFrame frame;
+    for (int tick = 0; tick < 500; ++tick) {
+        simulateTick(roadData, frame, SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
+
+    size_t allocationsBefore = allocationsCount;
+    for (int tick = 0; tick < 2000; ++tick) {
+        simulateTick(roadData, frame, SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
+    ASSERT_EQ(allocationsCount, allocationsBefore);
+    destroyCars(roadData);
+}
+
+TEST(Simulator, ParallelDecisionsMatchSerial)
+{
+    sRoadData roadData = createDefaultRoadData(9);
+    spawnCars(roadData, 3000);
+    queueCarsBehindSpawns(roadData);
+    sSimulationFrame frame;
+    for (int tick = 0; tick < 50; ++tick) {
+        simulateTick(roadData, frame, SCREEN_WIDTH, SCREEN_HEIGHT);
+    }
+
+    auto verboseCarsInfo = getVerboseCarsInfo(roadData);
+    sCarGrid grid;
+    sLaneIndex lanes;
+    std::vector<sCarMove> serialMoves, parallelMoves;
+    getNextCarsPositionPairs(roadData, verboseCarsInfo, grid, lanes, serialMoves);
+    sThreadPool pool(3);
+    getNextCarsPositionPairs(roadData, verboseCarsInfo, grid, lanes, parallelMoves, &pool);
+
+    ASSERT_EQ(serialMoves.size(), parallelMoves.size());
+    for (size_t i = 0; i < serialMoves.size(); ++i) {
+        ASSERT_EQ(serialMoves[i].first, parallelMoves[i].first);
+        ASSERT_EQ(serialMoves[i].second, parallelMoves[i].second);
+    }
+    destroyCars(roadData);
+}
+
+TEST(Simulator, LaneLeadersMatchFullScan)
+{
+    sRoadData roadData = createGridRoadData(3, 3, 640, 640, 4);
+    spawnCars(roadData, 600);
+    queueCarsBehindSpawns(roadData);
+    sSimulationFrame frame;
+    for (int tick = 0; tick < 300; ++tick) {
+        simulateTick(roadData, frame, 640, 640);
+        if (tick % 10 != 0)
+            continue;
+
+        // lanes are refreshed from the previous tick's order, respawns included
+        auto verboseCarsInfo = getVerboseCarsInfo(roadData);
+        std::vector<sCarMove> laneMoves;
+        getNextCarsPositionPairs(roadData, verboseCarsInfo, frame.grid, frame.lanes, laneMoves);
+        for (size_t i = 0; i < verboseCarsInfo.size(); ++i) {
+            sCarMove scanMove = getNextCarPositionPair(verboseCarsInfo[i], verboseCarsInfo, roadData);
+            ASSERT_EQ(scanMove.second, laneMoves[i].second) << "car " << i << " at tick " << tick;
+        }
+    }
+    destroyCars(roadData);
+}
+
+TEST(Parallel, TripleBufferHandsOverWholeLatestValues)
+{
+    const int last = 20000;
+    sTripleBuffer<std::vector<int>> buffer;
+    std::thread producer([&] {
+        for (int value = 1; value <= last; ++value) {
+            buffer.back().assign(64, value);
+            buffer.publish();
+        }
+    });
+
+    // every value taken is whole and newer than the one before
+    int seen = 0;
+    while (seen < last) {
+        if (!buffer.acquire())
+            continue;
+        const std::vector<int> &value = buffer.front();
+        ASSERT_EQ(value.size(), 64u);
+        ASSERT_GT(value.front(), seen);
+        ASSERT_TRUE(std::all_of(value.begin(), value.end(), [&](int element) { return element == value.front(); }));
+        seen = value.front();
+    }
+    producer.join();
+    ASSERT_FALSE(buffer.acquire());
+}
+
+TEST(Simulator, SameSeedGivesSameRun)
+{
+    auto runPositions = [](uint64_t seed) {
+        sRoadData roadData = createDefaultRoadData(seed);
+        spawnCars(roadData, 100);
+        sSimulationFrame frame;
+        for (int tick = 0; tick < 1000; ++tick) {
+            simulateTick(roadData, frame, SCREEN_WIDTH, SCREEN_HEIGHT);
+        }
+        std::vector<int> positions(roadData.cars.x);
+        positions.insert(positions.end(), roadData.cars.y.begin(), roadData.cars.y.end());
+        destroyCars(roadData);
+        return positions;
+    };
+
+    ASSERT_EQ(runPositions(42), runPositions(42));
+    ASSERT_NE(runPositions(42), runPositions(43));
+}
+
+TEST(Events, SkippedTicksMatchTickEngine)
+{
+    const int fieldSize = 4 * GRID_BLOCK_SIZE;
+    auto createRoad = [&](int carsCount, bool grid) {
+        sRoadData roadData = grid ? createGridRoadData(3, 3, fieldSize, fieldSize, 12) : createDefaultRoadData(12);
+        spawnCars(roadData, carsCount);
+        queueCarsBehindSpawns(roadData);
+        return roadData;
+    };
+
+    // a few cars to skip most ticks, and a busy grid where events keep coming
+    const std::pair<int, bool> runs[] = {{4, false}, {4, true}, {60, true}};
+    for (auto &run : runs) {
+        int carsCount = run.first;
+        bool grid = run.second;
+        int width = grid ? fieldSize : SCREEN_WIDTH, height = grid ? fieldSize : SCREEN_HEIGHT;
+        sRoadData ticked = createRoad(carsCount, grid), skipped = createRoad(carsCount, grid);
+        sSimulationFrame tickedFrame, skippedFrame;
+        sEventEngine events(width, height);
+        sRandom chunks(5);
+        for (int tick = 0; tick < 5000;) {
+            int chunk = 1 + chunks.nextBelow(40);
+            for (int i = 0; i < chunk; ++i) {
+                simulateTick(ticked, tickedFrame, width, height);
+            }
+            events.advance(skipped, skippedFrame, chunk);
+            tick += chunk;
+            ASSERT_TRUE(sameRoadState(ticked, skipped)) << "diverged by tick " << tick << (grid ? " on the grid" : " on the default road");
+        }
+        if (carsCount < 10) {
+            EXPECT_GT(events.skippedTicks, events.steppedTicks);
+        }
+        destroyCars(ticked);
+        destroyCars(skipped);
+    }
+}
+
+TEST(Tiles, TiledTickMatchesSimulateTick)
+{
+    const int fieldSize = 7 * GRID_BLOCK_SIZE;
+    auto createRoad = [&]() {
+        sRoadData roadData = createGridRoadData(6, 6, fieldSize, fieldSize, 21);
+        spawnCars(roadData, 600);
+        return roadData;
+    };
+
+    // stacked spawns make the first ticks push cars across tile borders
+    sRoadData ticked = createRoad(), tiled = createRoad();
+    sSimulationFrame frame;
+    sThreadPool pool(3);
+    sTiledWorld world(fieldSize, fieldSize, 5, 4);
+    world.pool = &pool;
+    for (int tick = 1; tick <= 400; ++tick) {
+        simulateTick(ticked, frame, fieldSize, fieldSize);
+        world.tick(tiled, fieldSize, fieldSize);
+        ASSERT_TRUE(sameRoadState(ticked, tiled)) << "diverged at tick " << tick;
+    }
+    destroyCars(ticked);
+    destroyCars(tiled);
+}
+
+TEST(Distributed, OneProcessMatchesSimulateTick)
+{
+    const int fieldSize = 5 * GRID_BLOCK_SIZE;
+    auto createRoad = [&]() {
+        sRoadData roadData = createGridRoadData(4, 4, fieldSize, fieldSize, 8);
+        spawnCars(roadData, 300);
+        queueCarsBehindSpawns(roadData);
+        return roadData;
+    };
+
+    sRoadData ticked = createRoad(), distributedRoad = createRoad();
+    sSimulationFrame frame;
+    {
+        sDistributedRoad distributed(distributedRoad, fieldSize, fieldSize, 1);
+        ASSERT_TRUE(distributedRoad.cars.empty());
+        for (int tick = 1; tick <= 300; ++tick) {
+            simulateTick(ticked, frame, fieldSize, fieldSize);
+            distributed.tick();
+        }
+        distributed.gather(distributedRoad);
+    }
+    ASSERT_EQ(ticked.cars.x, distributedRoad.cars.x);
+    ASSERT_EQ(ticked.cars.y, distributedRoad.cars.y);
+    ASSERT_EQ(ticked.cars.directions, distributedRoad.cars.directions);
+    ASSERT_EQ(ticked.cars.flags, distributedRoad.cars.flags);
+    destroyCars(ticked);
+    destroyCars(distributedRoad);
+}
+
+TEST(Distributed, BandsKeepEveryCarThroughFailedWorkers)
+{
+    const int fieldSize = 5 * GRID_BLOCK_SIZE, carsCount = 100, ticks = 600;
+    auto run = [&](bool failWorkers) {
+        sRoadData roadData = createGridRoadData(4, 4, fieldSize, fieldSize, 8);
+        spawnCars(roadData, carsCount);
+        queueCarsBehindSpawns(roadData);
+        sDistributedRoad distributed(roadData, fieldSize, fieldSize, 3, 200);
+        for (int tick = 1; tick <= ticks; ++tick) {
+            // the coordinator takes over the band of a worker that dies or hangs
+            if (failWorkers && tick == 300)
+                kill(distributed.workerPid(1), SIGKILL);
+            if (failWorkers && tick == 400)
+                kill(distributed.workerPid(2), SIGSTOP);
+            distributed.tick();
+        }
+        distributed.gather(roadData);
+        EXPECT_EQ(roadData.cars.size(), static_cast<size_t>(carsCount));
+
+        long carTicks = 0;
+        size_t cars = 0;
+        for (auto &stats : distributed.regions) {
+            EXPECT_GT(stats.carTicks, 0);
+            carTicks += stats.carTicks;
+            cars += stats.cars;
+        }
+        EXPECT_EQ(carTicks, static_cast<long>(carsCount) * ticks);
+        EXPECT_EQ(cars, static_cast<size_t>(carsCount));
+        if (failWorkers) {
+            EXPECT_FALSE(distributed.regions[1].alive);
+            EXPECT_EQ(distributed.regions[1].takenOverTicks, 301);
+            EXPECT_FALSE(distributed.regions[2].alive);
+            EXPECT_EQ(distributed.regions[2].takenOverTicks, 201);
+        } else {
+            EXPECT_TRUE(distributed.regions[1].alive && distributed.regions[2].alive);
+            EXPECT_GT(distributed.regions[1].haloCarTicks, 0);
+            EXPECT_GT(distributed.regions[1].arrivals, 0);
+        }
+        return roadData;
+    };
+
+    // bands run the same way every time
+    sRoadData first = run(false), second = run(false);
+    ASSERT_EQ(first.cars.x, second.cars.x);
+    ASSERT_EQ(first.cars.y, second.cars.y);
+    sRoadData failed = run(true);
+    destroyCars(first);
+    destroyCars(second);
+    destroyCars(failed);
+}
+
+// Plays cursor moves and characters from a terminal display onto a screen
+static void playAnsi(const std::string &output, std::vector<std::string> &screen)
+{
+    int row = 0, column = 0;
+    for (size_t i = 0; i < output.size(); ++i) {
+        if (output[i] != '\x1b') {
+            screen[row][column++] = output[i];
+            continue;
+        }
+        size_t end = output.find_first_of("HJ", i);
+        if (output[end] == 'H')
+            std::sscanf(output.c_str() + i, "\x1b[%d;%dH", &row, &column), --row, --column;
+        i = end;
+    }
+}
+
+TEST(Terminal, DiffFramesRebuildTheFullFrame)
+{
+    const int width = 160, height = 120;
+    sRoadData roadData = createGridRoadData(1, 1, width, height, 3);
+    spawnCars(roadData, 6);
+    sSimulationFrame frame;
+    sTerminalDisplay display(width, height);
+    std::vector<std::string> screen(height, std::string(width, ' '));
+    for (int tick = 0; tick < 100; ++tick) {
+        simulateTick(roadData, frame, width, height);
+        display.drawBackground();
+        display.drawRoadData(roadData);
+        const std::string &output = display.diffFrame();
+        playAnsi(output, screen);
+        if (tick > 0) {
+            ASSERT_LT(output.size(), static_cast<size_t>(width * height / 10));
+        }
+    }
+
+    sTerminalDisplay fresh(width, height);
+    fresh.drawBackground();
+    fresh.drawRoadData(roadData);
+    std::vector<std::string> expected(height, std::string(width, ' '));
+    playAnsi(fresh.diffFrame(), expected);
+    ASSERT_EQ(screen, expected);
+
+    // a downscaled cell shows something when any field cell in its block does
+    const int scale = 3, columns = (width + scale - 1) / scale, rows = (height + scale - 1) / scale;
+    sTerminalDisplay scaled(width, height, scale);
+    scaled.drawBackground();
+    scaled.drawRoadData(roadData);
+    std::vector<std::string> scaledScreen(rows, std::string(columns, ' '));
+    playAnsi(scaled.diffFrame(), scaledScreen);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            // screens are top row first, blocks count from the bottom of the field
+            if (expected[height - 1 - y][x] != ' ') {
+                ASSERT_NE(scaledScreen[rows - 1 - y / scale][x / scale], ' ');
+            }
+        }
+    }
+    destroyCars(roadData);
+}
+
+TEST(Profiler, HistogramPercentilesStayWithinBucketPrecision)
+{
+    sLatencyHistogram histogram;
+    for (uint64_t value = 1; value <= 100000; ++value) {
+        histogram.record(value * 1000);
+    }
+
+    ASSERT_EQ(histogram.count, 100000u);
+    ASSERT_EQ(histogram.max, 100000000u);
+    const double fractions[] = {0.5, 0.99, 0.999};
+    for (double fraction : fractions) {
+        double exact = fraction * 100000 * 1000;
+        ASSERT_NEAR(histogram.percentile(fraction), exact, exact / 32);
+    }
+    ASSERT_EQ(histogram.percentile(1.0), histogram.max);
+}
+
+TEST(Trace, SeekRestoresRecordedTicks)
+{
+    std::string path = testing::TempDir() + "cars_simulator_trace_test.bin";
+    sRoadData roadData = createDefaultRoadData(5);
+    spawnCars(roadData, 60);
+    sSimulationFrame frame;
+
+    std::vector<std::vector<int>> recorded;
+    {
+        sTraceWriter writer(path, roadData, 16);
+        for (int tick = 0; tick < 200; ++tick) {
+            simulateTick(roadData, frame, SCREEN_WIDTH, SCREEN_HEIGHT);
+            writer.record(roadData);
+            std::vector<int> state(roadData.cars.x);
+            state.insert(state.end(), roadData.cars.y.begin(), roadData.cars.y.end());
+            state.insert(state.end(), roadData.cars.crossings.begin(), roadData.cars.crossings.end());
+            for (size_t i = 0; i < roadData.cars.size(); ++i) {
+                state.push_back(roadData.cars.hasFlag(i, sCarStore::CHECK_SIDES));
+                state.push_back(roadData.cars.rect(i).width());
+            }
+            recorded.push_back(state);
+        }
+        writer.close();
+    }
+    destroyCars(roadData);
+
+    sTraceReader reader(path);
+    ASSERT_EQ(reader.ticksCount(), recorded.size());
+    sRoadData replayed = reader.createRoadData();
+    const size_t ticks[] = {150, 3, 4, 31, 32, 199, 0, 17};
+    for (size_t tick : ticks) {
+        reader.seek(tick, replayed);
+        std::vector<int> state(replayed.cars.x);
+        state.insert(state.end(), replayed.cars.y.begin(), replayed.cars.y.end());
+        state.insert(state.end(), replayed.cars.crossings.begin(), replayed.cars.crossings.end());
+        for (size_t i = 0; i < replayed.cars.size(); ++i) {
+            state.push_back(replayed.cars.hasFlag(i, sCarStore::CHECK_SIDES));
+            state.push_back(replayed.cars.rect(i).width());
+        }
+        ASSERT_EQ(state, recorded[tick]) << "tick " << tick;
+    }
+    destroyCars(replayed);
+
+    // a ticks count in the trailer that the index can't hold is refused
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(-static_cast<std::streamoff>(TRACE_TRAILER_SIZE - 8), std::ios::end);
+        const unsigned char ticks[8] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x7f};
+        file.write(reinterpret_cast<const char *>(ticks), sizeof(ticks));
+    }
+    ASSERT_THROW(sTraceReader{path}, std::runtime_error);
+    std::remove(path.c_str());
+}
+
+TEST(Snapshot, RestoredRoadContinuesTheSameRun)
+{
+    std::string path = testing::TempDir() + "cars_simulator_snapshot_test.bin";
+    auto runPositions = [](sRoadData &roadData, int ticks) {
+        sSimulationFrame frame;
+        for (int tick = 0; tick < ticks; ++tick) {
+            simulateTick(roadData, frame, SCREEN_WIDTH, SCREEN_HEIGHT);
+        }
+        std::vector<int> positions(roadData.cars.x);
+        positions.insert(positions.end(), roadData.cars.y.begin(), roadData.cars.y.end());
+        positions.insert(positions.end(), roadData.cars.crossings.begin(), roadData.cars.crossings.end());
+        return positions;
+    };
+
+    sRoadData roadData = createDefaultRoadData(9);
+    spawnCars(roadData, 100);
+    runPositions(roadData, 300);
+    saveSnapshot(roadData, SCREEN_WIDTH, SCREEN_HEIGHT, path);
+    std::vector<int> expected = runPositions(roadData, 500);
+
+    int fieldWidth = 0, fieldHeight = 0;
+    sRoadData restored = loadSnapshot(path, fieldWidth, fieldHeight);
+    ASSERT_EQ(fieldWidth, SCREEN_WIDTH);
+    ASSERT_EQ(fieldHeight, SCREEN_HEIGHT);
+    ASSERT_EQ(restored.cars.size(), roadData.cars.size());
+    for (size_t i = 0; i < restored.cars.size(); ++i) {
+        ASSERT_EQ(restored.cars[i]->kind, roadData.cars[i]->kind);
+    }
+    ASSERT_EQ(runPositions(restored, 500), expected);
+
+    // a car registered in a crossing that isn't there is refused
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        sSnapshotHeader header;
+        file.read(reinterpret_cast<char *>(&header), sizeof(header));
+        int crossing = static_cast<int>(roadData.crossings.size());
+        file.seekp(header.sections[SNAPSHOT_CAR_CROSSINGS].offset);
+        file.write(reinterpret_cast<const char *>(&crossing), sizeof(crossing));
+    }
+    ASSERT_THROW(loadSnapshot(path, fieldWidth, fieldHeight), std::runtime_error);
+
+    destroyCars(roadData);
+    destroyCars(restored);
+    std::remove(path.c_str());
+}
+
+TEST(Scenario, FileDescribesTheDefaultRoad)
+{
+    std::string path = testing::TempDir() + "cars_simulator_scenario_test.txt";
+    {
+        std::ofstream file(path);
+        file << "# two roads\nfield 640 480\nlane 40\n"
+                "segment 0 240 640 240\nsegment 213 480 213 0\n"
+                "spawn 0 240 east\nspawn 640 240 west\nspawn 213 480 south  # bottom\nspawn 213 0 north\n";
+    }
+
+    int fieldWidth = 0, fieldHeight = 0;
+    sRoadData loaded = loadScenario(path, 1, fieldWidth, fieldHeight);
+    sRoadData builtIn = createDefaultRoadData(1);
+    ASSERT_EQ(fieldWidth, SCREEN_WIDTH);
+    ASSERT_EQ(fieldHeight, SCREEN_HEIGHT);
+    ASSERT_EQ(loaded.spawns, builtIn.spawns);
+    ASSERT_EQ(loaded.crossings.size(), builtIn.crossings.size());
+    for (size_t c = 0; c < loaded.crossings.size(); ++c) {
+        ASSERT_EQ(loaded.crossings[c].rect.p1, builtIn.crossings[c].rect.p1);
+        ASSERT_EQ(loaded.crossings[c].rect.p2, builtIn.crossings[c].rect.p2);
+    }
+
+    {
+        std::ofstream file(path);
+        file << "segment 0 240 640 240\nspawn 0 240 sideways\n";
+    }
+    ASSERT_THROW(loadScenario(path, 1, fieldWidth, fieldHeight), std::runtime_error);
+    std::remove(path.c_str());
+}